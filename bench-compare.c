@@ -0,0 +1,157 @@
+/*
+ * Compares json-bench -j results against a stored baseline, and fails if
+ * throughput dropped, or memory use grew, by more than a threshold.
+ */
+#include "json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char *read_file(const char *path)
+{
+	FILE *fp = fopen(path, "rb");
+	char *buf = NULL;
+	size_t len = 0, size = 0;
+
+	if (!fp) {
+		perror(path);
+		exit(2);
+	}
+
+	while (!feof(fp)) {
+		size = size ? size * 2 : 4096;
+		buf = realloc(buf, size + 1);
+		if (!buf) {
+			perror("realloc");
+			exit(2);
+		}
+		len += fread(buf + len, 1, size - len, fp);
+	}
+	fclose(fp);
+	buf[len] = '\0';
+	return buf;
+}
+
+static const char *path;
+
+static void error(int line, const char *str)
+{
+	fprintf(stderr, "%s:%d: %s\n", path, line, str);
+	exit(2);
+}
+
+static const struct json_value *load_results(struct json_parser *p,
+                                             const char *file, char **str)
+{
+	const struct json_value *root, *results;
+
+	path = file;
+	*str = read_file(file);
+	root = json_parse(p, *str, error);
+	results = json_object_get(root, "results");
+	if (!results || results->type != JSON_ARRAY) {
+		fprintf(stderr, "%s: no results array\n", file);
+		exit(2);
+	}
+	return results;
+}
+
+static const struct json_value *find(const struct json_value *results,
+                                     const char *name)
+{
+	int i;
+
+	for (i = 0; i < json_array_size(results); ++i) {
+		const struct json_value *v = json_array_get(results, i);
+		const struct json_value *n = json_object_get(v, "name");
+		if (n && json_string(n) && !strcmp(json_string(n), name))
+			return v;
+	}
+	return NULL;
+}
+
+/*
+ * Compares one metric, where more is better unless lower_is_better is set.
+ * Returns non-zero for a regression beyond threshold percent.
+ */
+static int compare(const char *name, const char *metric, double before,
+                   double after, int lower_is_better, double threshold)
+{
+	double change = before ? (after - before) / before * 100 : 0;
+	int regressed = lower_is_better ? change > threshold :
+	                                  change < -threshold;
+	int digits = lower_is_better ? 0 : 1; /* bytes are whole numbers */
+
+	printf("%-36s %12.*f -> %12.*f %-6s %+7.1f%%%s\n", name, digits, before,
+	       digits, after, metric, change, regressed ? "  REGRESSION" : "");
+	return regressed;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-t threshold-percent] baseline.json "
+	                "current.json\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct json_parser *p = json_create_parser();
+	const struct json_value *baseline, *current;
+	double threshold = 10;
+	int opt, i, regressions = 0;
+	char *str[2];
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			threshold = atof(optarg);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	baseline = load_results(p, argv[optind], &str[0]);
+	current = load_results(p, argv[optind + 1], &str[1]);
+
+	for (i = 0; i < json_array_size(baseline); ++i) {
+		const struct json_value *before = json_array_get(baseline, i);
+		const struct json_value *name = json_object_get(before, "name");
+		const struct json_value *after, *a, *b;
+
+		if (!name || !json_string(name))
+			continue;
+
+		after = find(current, json_string(name));
+		if (!after) {
+			printf("%-36s missing\n", json_string(name));
+			continue;
+		}
+
+		if ((b = json_object_get(before, "mb_per_s")) &&
+		    (a = json_object_get(after, "mb_per_s")))
+			regressions += compare(json_string(name), "MB/s",
+			                       json_number(b), json_number(a),
+			                       0, threshold);
+
+		if ((b = json_object_get(before, "bytes")) &&
+		    (a = json_object_get(after, "bytes")))
+			regressions += compare(json_string(name), "bytes",
+			                       json_number(b), json_number(a),
+			                       1, threshold);
+	}
+
+	printf("%d regression%s beyond %.1f%%\n", regressions,
+	       regressions == 1 ? "" : "s", threshold);
+
+	json_destroy_parser(p);
+	free(str[0]);
+	free(str[1]);
+	return regressions ? 1 : 0;
+}
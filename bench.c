@@ -0,0 +1,414 @@
+#include "json.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint32_t rand_state = 1;
+
+static uint32_t rand_next(void)
+{
+	/* xorshift32, so the corpus is the same on every run */
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+struct buf {
+	char *data;
+	size_t len, size;
+};
+
+static void append(struct buf *b, const char *fmt, ...)
+{
+	va_list va;
+	int len;
+
+	while (1) {
+		va_start(va, fmt);
+		len = vsnprintf(b->data + b->len, b->size - b->len, fmt, va);
+		va_end(va);
+
+		if (len >= 0 && (size_t)len < b->size - b->len)
+			break;
+
+		b->size = b->size ? b->size * 2 : 4096;
+		b->data = realloc(b->data, b->size);
+		if (!b->data) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	b->len += len;
+}
+
+/* an array of records of the kind found in typical API responses */
+static char *generate_corpus(size_t size)
+{
+	struct buf b = { NULL, 0, 0 };
+	int i;
+
+	append(&b, "[");
+	for (i = 0; b.len < size; ++i) {
+		uint32_t r = rand_next();
+		append(&b, "%s{\"id\":%d,\"name\":\"user_%08x\",\"score\":%d.%03d,"
+		       "\"active\":%s,\"tags\":[\"t%u\",\"t%u\",\"t%u\"],"
+		       "\"location\":{\"lat\":%d.%06u,\"lon\":%d.%06u},"
+		       "\"bio\":\"line one\\nline \\\"two\\\" \\u00e6\\u00f8\\u00e5\","
+		       "\"parent\":null}",
+		       i ? "," : "", i, r, r % 1000, r % 997,
+		       r & 1 ? "true" : "false", r % 7, r % 11, r % 13,
+		       (int)(r % 180) - 90, rand_next() % 1000000,
+		       (int)(r % 360) - 180, rand_next() % 1000000);
+	}
+	append(&b, "]");
+	return b.data;
+}
+
+/* pretty-printed, string-heavy documents, where scanning dominates */
+static char *generate_text_corpus(size_t size)
+{
+	static const char words[][8] = {
+		"lorem", "ipsum", "dolor", "sit", "amet", "\\\"q\\\"", "elit",
+		"sed", "do", "tempor", "\\u00e6", "magna"
+	};
+	struct buf b = { NULL, 0, 0 };
+	int i, j;
+
+	append(&b, "[");
+	for (i = 0; b.len < size; ++i) {
+		int len = 5 + rand_next() % 60;
+		append(&b, "%s\n\t\t\t\t\"", i ? "," : "");
+		for (j = 0; j < len; ++j)
+			append(&b, "%s%s", j ? " " : "",
+			       words[rand_next() % (sizeof(words) / sizeof(*words))]);
+		append(&b, "\"");
+	}
+	append(&b, "\n]");
+	return b.data;
+}
+
+static void error(int line, const char *str)
+{
+	fprintf(stderr, "ERROR:%d: %s\n", line, str);
+	exit(1);
+}
+
+static double checksum(const struct json_value *v)
+{
+	double ret = 0;
+	int i;
+
+	switch (v->type) {
+	case JSON_STRING:
+		return strlen(v->value.string);
+
+	case JSON_NUMBER:
+		return v->value.number;
+
+	case JSON_DECIMAL:
+		return json_number(v);
+
+	case JSON_OBJECT:
+		for (i = 0; i < v->value.object.num_properties; ++i)
+			ret += checksum(v->value.object.properties[i].value);
+		return ret;
+
+	case JSON_ARRAY:
+		for (i = 0; i < v->value.array.num_values; ++i)
+			ret += checksum(v->value.array.values[i]);
+		return ret;
+
+	case JSON_BOOLEAN:
+		return v->value.boolean;
+
+	case JSON_NULL:
+		break;
+	}
+	return ret;
+}
+
+/* with -j, results are written as JSON, for bench-compare */
+static int json_output, num_results;
+
+/* progress and context, kept out of the way of JSON results */
+static void note(const char *fmt, ...)
+{
+	va_list va;
+	va_start(va, fmt);
+	vfprintf(json_output ? stderr : stdout, fmt, va);
+	va_end(va);
+}
+
+static void report(const char *name, double seconds, size_t bytes)
+{
+	if (json_output)
+		printf("%s\t\t{ \"name\": \"%s\", \"ms\": %.3f, "
+		       "\"mb_per_s\": %.1f }", num_results++ ? ",\n" : "",
+		       name, seconds * 1e3, bytes / seconds / 1e6);
+	else
+		printf("%-36s %10.3f ms %10.1f MB/s\n", name, seconds * 1e3,
+		       bytes / seconds / 1e6);
+}
+
+static void report_memory(const char *name, size_t bytes)
+{
+	if (json_output)
+		printf("%s\t\t{ \"name\": \"%s\", \"bytes\": %zu }",
+		       num_results++ ? ",\n" : "", name, bytes);
+	else
+		printf("%-36s %10zu bytes\n", name, bytes);
+}
+
+static int visit_checksum(const struct json_value *v, const char *name,
+                          int depth, void *data)
+{
+	double *sum = data;
+	(void)name;
+	(void)depth;
+
+	switch (v->type) {
+	case JSON_STRING:
+		*sum += strlen(v->value.string);
+		break;
+
+	case JSON_NUMBER:
+		*sum += v->value.number;
+		break;
+
+	case JSON_BOOLEAN:
+		*sum += v->value.boolean;
+		break;
+
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* traversal after the fact, where scattered memory hurts the most */
+static void bench_traverse(const struct json_value *root, size_t len,
+                           const char *name, int iterations)
+{
+	double best_walk = 1e9, best_visit = 1e9, sum = 0;
+	char label[64];
+	int i;
+
+	for (i = 0; i < iterations * 4; ++i) {
+		double start = now();
+		sum += checksum(root);
+		if (now() - start < best_walk)
+			best_walk = now() - start;
+
+		start = now();
+		json_visit(root, visit_checksum, &sum);
+		if (now() - start < best_visit)
+			best_visit = now() - start;
+	}
+
+	snprintf(label, sizeof(label), "traverse (%s)", name);
+	report(label, best_walk, len);
+	snprintf(label, sizeof(label), "json_visit (%s)", name);
+	report(label, best_visit, len);
+
+	if (sum == 42) /* keep the traversal from being optimized out */
+		putchar('\n');
+}
+
+static void bench_arena(const char *corpus, size_t len, unsigned flags,
+                        const char *name, int iterations)
+{
+	struct json_parser *p = json_create_parser();
+	struct json_document *doc;
+	struct json_value *root = NULL;
+	double best_parse = 1e9;
+	char label[64];
+	int i;
+
+	json_set_flags(p, flags);
+	for (i = 0; i < iterations; ++i) {
+		double start = now();
+		json_reset_parser(p);
+		root = json_parse(p, corpus, error);
+		if (now() - start < best_parse)
+			best_parse = now() - start;
+	}
+
+	snprintf(label, sizeof(label), "parse (%s)", name);
+	report(label, best_parse, len);
+	snprintf(label, sizeof(label), "memory (%s)", name);
+	report_memory(label, json_memory_usage(p));
+	if (!root) {
+		fprintf(stderr, "%s: corpus failed to parse\n", name);
+		exit(1);
+	}
+	bench_traverse(root, len, name, iterations);
+
+	doc = json_compact(root);
+	if (!doc) {
+		perror("json_compact");
+		exit(1);
+	}
+	snprintf(label, sizeof(label), "%s, compact", name);
+	bench_traverse(json_document_root(doc), len, label, iterations);
+	json_free_document(doc);
+	json_destroy_parser(p);
+}
+
+/* each set of scanning kernels the CPU supports, on the same corpus */
+static void bench_kernels(const char *corpus, size_t len, const char *name,
+                          int iterations)
+{
+	static const char *const kernels[] = {
+		"scalar", "sse2", "avx2", "avx512"
+	};
+	char label[64];
+	size_t k;
+	int i;
+
+	for (k = 0; k < sizeof(kernels) / sizeof(*kernels); ++k) {
+		struct json_parser *p;
+		double best = 1e9;
+
+		setenv("JSON_LOL_KERNELS", kernels[k], 1);
+		p = json_create_parser();
+		if (strcmp(json_kernel_name(p), kernels[k])) {
+			json_destroy_parser(p);
+			continue; /* not supported here */
+		}
+
+		for (i = 0; i < iterations; ++i) {
+			double start = now();
+			json_reset_parser(p);
+			json_parse(p, corpus, error);
+			if (now() - start < best)
+				best = now() - start;
+		}
+
+		snprintf(label, sizeof(label), "parse (%s, %s)", name,
+		         kernels[k]);
+		report(label, best, len);
+		json_destroy_parser(p);
+	}
+	unsetenv("JSON_LOL_KERNELS");
+}
+
+/*
+ * many tiny documents, like RPC messages, one by one and as a batch. The
+ * batch isn't meant to be faster, only to not cost more than the loop
+ */
+static void bench_batch(int count, int iterations)
+{
+	struct json_parser *p = json_create_parser();
+	struct json_value **roots = malloc(sizeof(*roots) * count);
+	const char **msgs = malloc(sizeof(*msgs) * count);
+	double best_single = 1e9, best_batch = 1e9;
+	size_t bytes = 0;
+	int i, j;
+
+	if (!roots || !msgs) {
+		perror("malloc");
+		exit(1);
+	}
+
+	for (i = 0; i < count; ++i) {
+		struct buf b = { NULL, 0, 0 };
+		uint32_t r = rand_next();
+		append(&b, "{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"m%u\","
+		       "\"params\":{\"key\":\"k%08x\",\"value\":%u,"
+		       "\"flags\":[%s,null]}}",
+		       i, r % 16, r, r % 1000, r & 1 ? "true" : "false");
+		msgs[i] = b.data;
+		bytes += b.len;
+	}
+
+	for (i = 0; i < iterations; ++i) {
+		double start = now();
+		json_reset_parser(p);
+		for (j = 0; j < count; ++j)
+			roots[j] = json_parse(p, msgs[j], error);
+		if (now() - start < best_single)
+			best_single = now() - start;
+
+		start = now();
+		json_reset_parser(p);
+		json_parse_batch(p, msgs, count, roots, error);
+		if (now() - start < best_batch)
+			best_batch = now() - start;
+	}
+
+	note("%d messages, %zu bytes\n", count, bytes);
+	report("parse (one by one)", best_single, bytes);
+	report("parse (batch)", best_batch, bytes);
+	report_memory("memory (batch)", json_memory_usage(p));
+
+	for (i = 0; i < count; ++i)
+		free((char *)msgs[i]);
+	free(msgs);
+	free(roots);
+	json_destroy_parser(p);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t size = 64, len;
+	int iterations = 5, opt;
+	char *corpus;
+
+	while ((opt = getopt(argc, argv, "j")) != -1) {
+		switch (opt) {
+		case 'j':
+			json_output = 1;
+			break;
+
+		default:
+			fprintf(stderr, "usage: %s [-j] [size-mb [iterations]]\n",
+			        argv[0]);
+			exit(1);
+		}
+	}
+	if (optind < argc)
+		size = atol(argv[optind]);
+	if (optind + 1 < argc)
+		iterations = atoi(argv[optind + 1]);
+	if (iterations < 1) {
+		fprintf(stderr, "%s: need at least one iteration\n", argv[0]);
+		exit(1);
+	}
+
+	corpus = generate_corpus(size << 20);
+	len = strlen(corpus);
+	if (json_output)
+		printf("{\n\t\"size_mb\": %zu,\n\t\"iterations\": %d,\n"
+		       "\t\"results\": [\n", size, iterations);
+
+	note("corpus: %zu bytes\n", len);
+	bench_arena(corpus, len, 0, "regular pages", iterations);
+	bench_arena(corpus, len, JSON_HUGE_PAGES, "huge pages", iterations);
+	bench_batch(100000, iterations);
+
+	bench_kernels(corpus, len, "records", iterations);
+	free(corpus);
+
+	corpus = generate_text_corpus(size << 20);
+	len = strlen(corpus);
+	note("text corpus: %zu bytes\n", len);
+	bench_kernels(corpus, len, "text", iterations);
+	free(corpus);
+
+	if (json_output)
+		printf("\n\t]\n}\n");
+	return 0;
+}
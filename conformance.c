@@ -0,0 +1,338 @@
+/*
+ * Runs JSONTestSuite-style cases through every engine, set of scanning
+ * kernels and flag. Files named y_* must be accepted, n_* rejected, and i_*
+ * may go either way, as long as everything agrees. Each case is timed too,
+ * so pathological ones stand out.
+ */
+#include "json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+	FILE *fp = fopen(path, "rb");
+	char *buf = NULL;
+	size_t size = 0;
+
+	if (!fp) {
+		perror(path);
+		exit(2);
+	}
+
+	*len = 0;
+	while (!feof(fp)) {
+		size = size ? size * 2 : 4096;
+		buf = realloc(buf, size + 1);
+		if (!buf) {
+			perror("realloc");
+			exit(2);
+		}
+		*len += fread(buf + *len, 1, size - *len, fp);
+	}
+	fclose(fp);
+	buf[*len] = '\0';
+	return buf;
+}
+
+static int failed;
+
+static void error(int line, const char *str)
+{
+	(void)line;
+	(void)str;
+	failed = 1;
+}
+
+static const struct json_value *parse_recursive(struct json_parser *p,
+                                                const char *str, int arg)
+{
+	(void)arg;
+	return json_parse(p, str, error);
+}
+
+static const struct json_value *parse_steps(struct json_parser *p,
+                                            const char *str, int slice)
+{
+	struct json_value *value;
+
+	json_parse_begin(p, str, error);
+	while (json_parse_step(p, slice, &value))
+		;
+	return value;
+}
+
+static const struct json_value *parse_chunks(struct json_parser *p,
+                                             const char *str, int chunk)
+{
+	struct json_value *value;
+	size_t len = strlen(str), pos = 0, n;
+
+	json_parse_begin(p, NULL, error);
+	do {
+		n = len - pos < (size_t)chunk ? len - pos : (size_t)chunk;
+		pos += n;
+	} while (json_parse_feed(p, str + pos - n, n, &value));
+	return value;
+}
+
+static void count_line(struct json_value *value, void *data)
+{
+	(void)value;
+	++*(int *)data;
+}
+
+static const struct json_value *parse_lines(struct json_parser *p,
+                                            const char *str, int arg)
+{
+	static const struct json_value line_value = { JSON_NULL, { NULL } };
+	int lines = 0;
+	(void)arg;
+
+	/* values don't outlive the callback, so stand in for one */
+	json_parse_lines(p, str, count_line, error, &lines);
+	return lines == 1 ? &line_value : NULL;
+}
+
+static const struct json_value *parse_sequence(struct json_parser *p,
+                                               const char *str, int arg)
+{
+	const struct json_value *value;
+	size_t offset = 0;
+	(void)arg;
+
+	/* a value followed by anything but whitespace isn't a document */
+	value = json_parse_next(p, str, &offset, error);
+	return str[offset] ? NULL : value;
+}
+
+static const struct json_value *parse_batch(struct json_parser *p,
+                                            const char *str, int arg)
+{
+	struct json_value *roots[2];
+	const char *strs[2];
+	(void)arg;
+
+	strs[0] = "{\"before\": [1, 2, 3]}";
+	strs[1] = str;
+	json_parse_batch(p, strs, 2, roots, error);
+	return roots[1];
+}
+
+enum {
+	RELAXED = 1 << 0, /* supports JSON_RELAXED */
+	ONE_LINE = 1 << 1 /* only takes documents without newlines */
+};
+
+static const struct engine {
+	const char *name, *kernels;
+	const struct json_value *(*parse)(struct json_parser *p,
+	                                  const char *str, int arg);
+	int arg, caps;
+} engines[] = {
+	{ "json_parse", NULL, parse_recursive, 0, RELAXED },
+	{ "json_parse_step 1", NULL, parse_steps, 1, 0 },
+	{ "json_parse_step 4096", NULL, parse_steps, 4096, 0 },
+	{ "json_parse_feed 1", NULL, parse_chunks, 1, 0 },
+	{ "json_parse_feed 4096", NULL, parse_chunks, 4096, 0 },
+	{ "json_parse_lines", NULL, parse_lines, 0, RELAXED | ONE_LINE },
+	{ "json_parse_next", NULL, parse_sequence, 0, RELAXED },
+	{ "json_parse_batch", NULL, parse_batch, 0, RELAXED },
+	{ "json_parse scalar", "scalar", parse_recursive, 0, RELAXED },
+	{ "json_parse sse2", "sse2", parse_recursive, 0, RELAXED },
+	{ "json_parse avx2", "avx2", parse_recursive, 0, RELAXED },
+	{ "json_parse avx512", "avx512", parse_recursive, 0, RELAXED },
+	{ "json_parse neon", "neon", parse_recursive, 0, RELAXED }
+};
+
+static const struct flag_set {
+	const char *name;
+	unsigned flags;
+} flag_sets[] = {
+	{ "", 0 },
+	{ ", exact numbers", JSON_EXACT_NUMBERS },
+	{ ", partial results", JSON_PARTIAL_RESULTS },
+	{ ", relaxed", JSON_RELAXED }
+};
+
+/* the slowest cases, for the report */
+#define NUM_SLOWEST 5
+
+static struct slow_case {
+	char name[256];
+	char mode[64];
+	double seconds;
+	size_t len;
+} slowest[NUM_SLOWEST];
+
+static void note_time(const char *name, const char *mode, double seconds,
+                      size_t len)
+{
+	int i = NUM_SLOWEST;
+
+	while (i > 0 && slowest[i - 1].seconds < seconds)
+		--i;
+	if (i == NUM_SLOWEST)
+		return;
+
+	memmove(&slowest[i + 1], &slowest[i],
+	        sizeof(*slowest) * (NUM_SLOWEST - 1 - i));
+	snprintf(slowest[i].name, sizeof(slowest[i].name), "%s", name);
+	snprintf(slowest[i].mode, sizeof(slowest[i].mode), "%s", mode);
+	slowest[i].seconds = seconds;
+	slowest[i].len = len;
+}
+
+/* runs one case in every mode, returning non-zero if any got it wrong */
+static int run_case(const char *path, int verbose, double max_seconds)
+{
+	const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	char expect = name[0], mode[64], slowest_mode[64] = "";
+	int result, first = -1, failures = 0;
+	double slowest_time = 0;
+	size_t len, e, f;
+	char *str;
+
+	if (expect != 'y' && expect != 'n' && expect != 'i') {
+		fprintf(stderr, "%s: not a y_, n_ or i_ case\n", path);
+		exit(2);
+	}
+
+	str = read_file(path, &len);
+	if (strlen(str) != len) {
+		/* the parsers take C strings, so the rest would go unseen */
+		printf("%-50s skipped, contains NUL bytes\n", name);
+		free(str);
+		return 0;
+	}
+
+	for (f = 0; f < sizeof(flag_sets) / sizeof(*flag_sets); ++f) {
+		unsigned flags = flag_sets[f].flags;
+
+		for (e = 0; e < sizeof(engines) / sizeof(*engines); ++e) {
+			const struct engine *eng = &engines[e];
+			struct json_parser *p;
+			double start, elapsed;
+
+			if ((flags & JSON_RELAXED) && !(eng->caps & RELAXED))
+				continue;
+			if ((eng->caps & ONE_LINE) && strpbrk(str, "\r\n"))
+				continue;
+
+			if (eng->kernels)
+				setenv("JSON_LOL_KERNELS", eng->kernels, 1);
+			p = json_create_parser();
+			unsetenv("JSON_LOL_KERNELS");
+			if (eng->kernels &&
+			    strcmp(json_kernel_name(p), eng->kernels)) {
+				json_destroy_parser(p);
+				continue; /* not supported here */
+			}
+			json_set_flags(p, flags);
+
+			failed = 0;
+			start = now();
+			result = eng->parse(p, str, eng->arg) && !failed;
+			elapsed = now() - start;
+			json_destroy_parser(p);
+
+			snprintf(mode, sizeof(mode), "%s%s", eng->name,
+			         flag_sets[f].name);
+			if (elapsed > slowest_time) {
+				slowest_time = elapsed;
+				snprintf(slowest_mode, sizeof(slowest_mode), "%s",
+				         mode);
+			}
+
+			/* relaxed syntax accepts a good deal of n_ cases */
+			if (flags & JSON_RELAXED) {
+				if (expect == 'y' && !result) {
+					printf("%-50s rejected by %s\n", name,
+					       mode);
+					++failures;
+				}
+				continue;
+			}
+
+			if (first < 0)
+				first = result;
+			if ((expect == 'y' && !result) ||
+			    (expect == 'n' && result) ||
+			    (expect == 'i' && result != first)) {
+				printf("%-50s %s by %s\n", name, result ?
+				       "accepted" : "rejected", mode);
+				++failures;
+			}
+		}
+	}
+
+	note_time(name, slowest_mode, slowest_time, len);
+	if (max_seconds && slowest_time > max_seconds) {
+		printf("%-50s took %.3f ms in %s\n", name, slowest_time * 1e3,
+		       slowest_mode);
+		++failures;
+	}
+
+	if (verbose && !failures)
+		printf("%-50s %-8s %9.3f ms  %s\n", name,
+		       first ? "accepted" : "rejected", slowest_time * 1e3,
+		       slowest_mode);
+
+	free(str);
+	return failures;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-v] [-t max-ms] case.json...\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, i, verbose = 0, failures = 0, failed_cases = 0;
+	double max_seconds = 0;
+
+	while ((opt = getopt(argc, argv, "vt:")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+
+		case 't':
+			max_seconds = atof(optarg) / 1e3;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc)
+		usage(argv[0]);
+
+	for (i = optind; i < argc; ++i) {
+		int n = run_case(argv[i], verbose, max_seconds);
+		failures += n;
+		failed_cases += !!n;
+	}
+
+	printf("%d cases, %d failed (%d mismatches)\nslowest:\n",
+	       argc - optind, failed_cases, failures);
+	for (i = 0; i < NUM_SLOWEST && slowest[i].seconds; ++i)
+		printf("  %-48s %9.3f ms %8.1f ns/byte  %s\n", slowest[i].name,
+		       slowest[i].seconds * 1e3,
+		       slowest[i].len ? slowest[i].seconds * 1e9 /
+		                        slowest[i].len : 0,
+		       slowest[i].mode);
+	return failed_cases ? 1 : 0;
+}
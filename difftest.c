@@ -0,0 +1,534 @@
+/*
+ * Differential testing: parses a generated corpus of valid and broken
+ * documents with every engine, set of scanning kernels and flag, and checks
+ * they all agree with json_parse() on the trees, or on the errors.
+ */
+#include "json.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint32_t rand_state = 1;
+
+static uint32_t rand_next(void)
+{
+	/* xorshift32, so a seed always gives the same corpus */
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+static uint32_t rand_below(uint32_t n)
+{
+	return rand_next() % n;
+}
+
+struct buf {
+	char *data;
+	size_t len, size;
+};
+
+static void append(struct buf *b, const char *fmt, ...)
+{
+	va_list va;
+	int len;
+
+	while (1) {
+		va_start(va, fmt);
+		len = vsnprintf(b->data + b->len, b->size - b->len, fmt, va);
+		va_end(va);
+
+		if (len >= 0 && (size_t)len < b->size - b->len)
+			break;
+
+		b->size = b->size ? b->size * 2 : 256;
+		b->data = realloc(b->data, b->size);
+		if (!b->data) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	b->len += len;
+}
+
+/* newlines are left out of documents for json_parse_lines() */
+static void gen_space(struct buf *b, int newlines)
+{
+	static const char *const spaces[] = { "", "", " ", "\t", "  ", "\n",
+	                                      "\r\n", "\n\t\t" };
+	append(b, "%s", spaces[rand_below(newlines ? 8 : 5)]);
+}
+
+/* long runs too, to cross the vector kernels' block boundaries */
+static void gen_string(struct buf *b)
+{
+	static const char *const pieces[] = {
+		"a", "b", "lorem", " ", "0", "\\\"", "\\\\", "\\/", "\\b", "\\f",
+		"\\n", "\\r", "\\t", "\\u00e6", "\\u20AC", "\\ud83d\\ude00",
+		"\xc3\xa6", "\xf0\x9f\x98\x80", "\x7f", "'"
+	};
+	int i, len = rand_below(4) ? rand_below(8) : rand_below(200);
+
+	append(b, "\"");
+	for (i = 0; i < len; ++i)
+		append(b, "%s", pieces[rand_below(rand_below(3) ? 5 :
+		                       sizeof(pieces) / sizeof(*pieces))]);
+	append(b, "\"");
+}
+
+static void gen_number(struct buf *b)
+{
+	switch (rand_below(8)) {
+	case 0:
+		append(b, "%u", rand_below(10));
+		break;
+
+	case 1:
+		append(b, "-%u", rand_next());
+		break;
+
+	case 2:
+		/* more digits than a double holds */
+		append(b, "%u%09u%09u", rand_next(), rand_below(1000000000),
+		       rand_below(1000000000));
+		break;
+
+	case 3:
+		append(b, "%d.%u", (int)rand_below(2000) - 1000, rand_next());
+		break;
+
+	case 4:
+		append(b, "%u%c%c%u", rand_below(100), "eE"[rand_below(2)],
+		       "+-0"[rand_below(3)], rand_below(400));
+		break;
+
+	case 5:
+		append(b, "-0.%09u%09ue-%u", rand_below(1000000000),
+		       rand_below(1000000000), rand_below(30));
+		break;
+
+	case 6:
+		append(b, "-0");
+		break;
+
+	default:
+		append(b, "%u.%ue%u", rand_below(10), rand_below(1000),
+		       rand_below(20));
+	}
+}
+
+static void gen_value(struct buf *b, int depth, int newlines)
+{
+	int i, n;
+
+	switch (rand_below(depth < 5 ? 8 : 6)) {
+	case 0:
+	case 1:
+		gen_string(b);
+		break;
+
+	case 2:
+	case 3:
+		gen_number(b);
+		break;
+
+	case 4:
+		append(b, "%s", rand_below(2) ? "true" : "false");
+		break;
+
+	case 5:
+		append(b, "null");
+		break;
+
+	case 6:
+		n = rand_below(8);
+		append(b, "[");
+		for (i = 0; i < n; ++i) {
+			append(b, "%s", i ? "," : "");
+			gen_space(b, newlines);
+			gen_value(b, depth + 1, newlines);
+			gen_space(b, newlines);
+		}
+		append(b, "]");
+		break;
+
+	default:
+		n = rand_below(6);
+		append(b, "{");
+		for (i = 0; i < n; ++i) {
+			append(b, "%s", i ? "," : "");
+			gen_space(b, newlines);
+			gen_string(b);
+			gen_space(b, newlines);
+			append(b, ":");
+			gen_space(b, newlines);
+			gen_value(b, depth + 1, newlines);
+			gen_space(b, newlines);
+		}
+		append(b, "}");
+	}
+}
+
+/* a valid document, or now and then a broken one */
+static char *gen_document(void)
+{
+	static const char junk[] = "{}[],:\"\\-+.0eEtnx \n\x01";
+	struct buf b = { NULL, 0, 0 };
+	int newlines = rand_below(2);
+	size_t pos;
+
+	gen_space(&b, newlines);
+	gen_value(&b, rand_below(2), newlines);
+	gen_space(&b, newlines);
+
+	switch (rand_below(8)) {
+	case 0:
+		b.data[rand_below(b.len + 1)] = '\0';
+		break;
+
+	case 1:
+		pos = rand_below(b.len);
+		b.data[pos] = junk[rand_below(sizeof(junk) - 1)];
+		break;
+	}
+	return b.data;
+}
+
+/*
+ * What an engine made of a document. With JSON_PARTIAL_RESULTS, there can
+ * be a root as well as an error.
+ */
+struct result {
+	const struct json_value *root;
+	struct json_document *doc;
+	char error[256];
+};
+
+static struct result *current;
+
+static void error(int line, const char *str)
+{
+	snprintf(current->error, sizeof(current->error), "%d: %s", line, str);
+}
+
+static void parse_recursive(struct json_parser *p, const char *str, int arg)
+{
+	(void)arg;
+	current->root = json_parse(p, str, error);
+}
+
+static void parse_steps(struct json_parser *p, const char *str, int slice)
+{
+	struct json_value *value;
+
+	json_parse_begin(p, str, error);
+	while (json_parse_step(p, slice, &value))
+		;
+	current->root = value;
+}
+
+static void parse_chunks(struct json_parser *p, const char *str, int chunk)
+{
+	struct json_value *value;
+	size_t len = strlen(str), pos = 0, n;
+
+	json_parse_begin(p, NULL, error);
+	do {
+		n = len - pos < (size_t)chunk ? len - pos : (size_t)chunk;
+		pos += n;
+	} while (json_parse_feed(p, str + pos - n, n, &value));
+	current->root = value;
+}
+
+static void keep_line(struct json_value *value, void *data)
+{
+	(void)value;
+	if (!current->doc)
+		current->doc = json_detach(data);
+}
+
+static void parse_lines(struct json_parser *p, const char *str, int arg)
+{
+	(void)arg;
+	json_parse_lines(p, str, keep_line, error, p);
+	if (current->doc)
+		current->root = json_document_root(current->doc);
+}
+
+static void parse_sequence(struct json_parser *p, const char *str, int arg)
+{
+	size_t offset = 0;
+	(void)arg;
+
+	current->root = json_parse_next(p, str, &offset, error);
+	if (current->root && str[offset] && !current->error[0]) {
+		/* there was junk after the value, which json_parse() rejects */
+		snprintf(current->error, sizeof(current->error),
+		         "json_parse_next stopped at offset %zu", offset);
+	}
+}
+
+static void parse_batch(struct json_parser *p, const char *str, int arg)
+{
+	struct json_value *roots[3];
+	const char *strs[3];
+	(void)arg;
+
+	/* between two documents of its own, to share the arena with */
+	strs[0] = strs[2] = "[1, \"two\", {\"three\": null}]";
+	strs[1] = str;
+	json_parse_batch(p, strs, 3, roots, error);
+	current->root = roots[1];
+}
+
+static void parse_compact(struct json_parser *p, const char *str, int arg)
+{
+	const struct json_value *root = json_parse(p, str, error);
+	(void)arg;
+
+	if (root) {
+		current->doc = json_compact(root);
+		if (!current->doc) {
+			perror("json_compact");
+			exit(1);
+		}
+		current->root = json_document_root(current->doc);
+	}
+}
+
+/*
+ * Engines that stop at the end of the line, or before junk, have errors of
+ * their own. Stream engines take blank input as the end of the stream, and
+ * only the recursive engine does relaxed syntax.
+ */
+enum {
+	SAME_ERRORS = 1 << 0,
+	ONE_LINE = 1 << 1,
+	STREAM = 1 << 2,
+	STRICT = 1 << 3
+};
+
+static const struct engine {
+	const char *name, *kernels;
+	void (*parse)(struct json_parser *p, const char *str, int arg);
+	int arg, caps;
+} engines[] = {
+	{ "json_parse_step 1", NULL, parse_steps, 1, SAME_ERRORS | STRICT },
+	{ "json_parse_step 64", NULL, parse_steps, 64, SAME_ERRORS | STRICT },
+	{ "json_parse_feed 1", NULL, parse_chunks, 1, SAME_ERRORS | STRICT },
+	{ "json_parse_feed 7", NULL, parse_chunks, 7, SAME_ERRORS | STRICT },
+	{ "json_parse_feed 4096", NULL, parse_chunks, 4096,
+	  SAME_ERRORS | STRICT },
+	{ "json_parse_lines", NULL, parse_lines, 0, ONE_LINE | STREAM },
+	{ "json_parse_next", NULL, parse_sequence, 0, STREAM },
+	{ "json_parse_batch", NULL, parse_batch, 0, SAME_ERRORS },
+	{ "json_compact", NULL, parse_compact, 0, SAME_ERRORS },
+	{ "json_parse scalar", "scalar", parse_recursive, 0, SAME_ERRORS },
+	{ "json_parse sse2", "sse2", parse_recursive, 0, SAME_ERRORS },
+	{ "json_parse avx2", "avx2", parse_recursive, 0, SAME_ERRORS },
+	{ "json_parse avx512", "avx512", parse_recursive, 0, SAME_ERRORS },
+	{ "json_parse neon", "neon", parse_recursive, 0, SAME_ERRORS },
+	{ "json_parse_feed 7 scalar", "scalar", parse_chunks, 7,
+	  SAME_ERRORS | STRICT },
+	{ "json_parse_feed 7 avx2", "avx2", parse_chunks, 7,
+	  SAME_ERRORS | STRICT }
+};
+
+/* flags every document is parsed with, in turn */
+static const unsigned flag_sets[] = {
+	0,
+	JSON_EXACT_NUMBERS,
+	JSON_PARTIAL_RESULTS,
+	JSON_RELAXED
+};
+
+/* the path to the first difference, or NULL if there's none */
+static const char *compare(const struct json_value *a,
+                           const struct json_value *b, char *path,
+                           size_t len, size_t size)
+{
+	int i;
+
+	if (a->type != b->type)
+		return path;
+
+	switch (a->type) {
+	case JSON_STRING:
+		return strcmp(a->value.string, b->value.string) ? path : NULL;
+
+	case JSON_NUMBER:
+		/* bit for bit, so -0 and 0 differ too */
+		return memcmp(&a->value.number, &b->value.number,
+		              sizeof(double)) ? path : NULL;
+
+	case JSON_DECIMAL:
+		return a->value.decimal.len != b->value.decimal.len ||
+		       memcmp(a->value.decimal.str, b->value.decimal.str,
+		              a->value.decimal.len) ? path : NULL;
+
+	case JSON_BOOLEAN:
+		return a->value.boolean != b->value.boolean ? path : NULL;
+
+	case JSON_NULL:
+		return NULL;
+
+	case JSON_ARRAY:
+		if (a->value.array.num_values != b->value.array.num_values)
+			return path;
+		for (i = 0; i < a->value.array.num_values; ++i) {
+			const char *ret;
+			snprintf(path + len, size - len, "[%d]", i);
+			ret = compare(a->value.array.values[i],
+			              b->value.array.values[i], path,
+			              strlen(path), size);
+			if (ret)
+				return ret;
+		}
+		path[len] = '\0';
+		return NULL;
+
+	case JSON_OBJECT:
+		if (a->value.object.num_properties !=
+		    b->value.object.num_properties)
+			return path;
+		for (i = 0; i < a->value.object.num_properties; ++i) {
+			const char *ret;
+			snprintf(path + len, size - len, ".%s",
+			         a->value.object.properties[i].name);
+			if (strcmp(a->value.object.properties[i].name,
+			           b->value.object.properties[i].name))
+				return path;
+			ret = compare(a->value.object.properties[i].value,
+			              b->value.object.properties[i].value, path,
+			              strlen(path), size);
+			if (ret)
+				return ret;
+		}
+		path[len] = '\0';
+		return NULL;
+	}
+	return path;
+}
+
+static struct json_parser *create_parser(const char *kernels, unsigned flags)
+{
+	struct json_parser *p;
+
+	if (kernels)
+		setenv("JSON_LOL_KERNELS", kernels, 1);
+	p = json_create_parser();
+	if (kernels)
+		unsetenv("JSON_LOL_KERNELS");
+
+	/* a set of kernels the CPU doesn't support */
+	if (kernels && strcmp(json_kernel_name(p), kernels)) {
+		json_destroy_parser(p);
+		return NULL;
+	}
+	json_set_flags(p, flags);
+	return p;
+}
+
+static int blank(const char *str)
+{
+	return !str[strspn(str, " \t\r\n")];
+}
+
+/* returns the number of engines that disagree with json_parse() */
+static int check(const char *doc, unsigned flags, size_t index)
+{
+	struct json_parser *ref_p = create_parser(NULL, flags);
+	struct result ref = { NULL, NULL, "" }, res;
+	int failures = 0;
+	size_t i;
+
+	current = &ref;
+	parse_recursive(ref_p, doc, 0);
+
+	for (i = 0; i < sizeof(engines) / sizeof(*engines); ++i) {
+		const struct engine *e = &engines[i];
+		struct json_parser *p;
+		const char *diff = NULL;
+		char path[256] = "$";
+
+		if ((flags & JSON_RELAXED) && (e->caps & STRICT))
+			continue;
+		if ((e->caps & ONE_LINE) && strpbrk(doc, "\r\n"))
+			continue;
+		if ((e->caps & STREAM) && blank(doc))
+			continue;
+		if (!(p = create_parser(e->kernels, flags)))
+			continue;
+
+		memset(&res, 0, sizeof(res));
+		current = &res;
+		e->parse(p, doc, e->arg);
+
+		if (!ref.error[0] != !res.error[0])
+			diff = ref.error[0] ? "succeeded" : "failed";
+		else if (ref.error[0] && !(e->caps & SAME_ERRORS))
+			; /* failing is all that's expected */
+		else if (!ref.root != !res.root)
+			diff = ref.root ? "returned no value" : "returned a value";
+		else if (ref.root &&
+		         compare(ref.root, res.root, path, 1, sizeof(path)))
+			diff = path;
+		else if ((e->caps & SAME_ERRORS) && strcmp(ref.error, res.error))
+			diff = "reported another error";
+
+		if (diff) {
+			fprintf(stderr, "document %zu, flags %#x: %s %s%s\n"
+			        "  json_parse: %s\n  %s: %s\n  input: %s\n",
+			        index, flags, e->name, diff == path ?
+			        "differs at " : "", diff,
+			        ref.error[0] ? ref.error : "ok", e->name,
+			        res.error[0] ? res.error : "ok", doc);
+			++failures;
+		}
+
+		if (res.doc)
+			json_free_document(res.doc);
+		json_destroy_parser(p);
+	}
+
+	json_destroy_parser(ref_p);
+	return failures;
+}
+
+int main(int argc, char *argv[])
+{
+	int count = 1000, opt, failures = 0, i;
+	size_t f;
+
+	while ((opt = getopt(argc, argv, "s:")) != -1) {
+		switch (opt) {
+		case 's':
+			rand_state = strtoul(optarg, NULL, 0);
+			if (!rand_state)
+				rand_state = 1;
+			break;
+
+		default:
+			fprintf(stderr, "usage: %s [-s seed] [documents]\n",
+			        argv[0]);
+			exit(2);
+		}
+	}
+	if (optind < argc)
+		count = atoi(argv[optind]);
+
+	for (i = 0; i < count; ++i) {
+		char *doc = gen_document();
+		for (f = 0; f < sizeof(flag_sets) / sizeof(*flag_sets); ++f)
+			failures += check(doc, flag_sets[f], i);
+		free(doc);
+	}
+
+	printf("%d documents, %d differences\n", count, failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,378 @@
+/*
+ * libFuzzer harness, running each input through every parsing engine. On top
+ * of crashes, it flags inputs that take too long to parse per byte, since
+ * those point at quadratic behavior. Built with -DFUZZ_REPLAY, it runs the
+ * files given on the command line instead, without libFuzzer. Those are
+ * inputs as libFuzzer saves them, or with -o, plain JSON that gets the given
+ * option byte put in front.
+ */
+#include "json.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * How many times slower per byte than a baseline document an input may parse
+ * before it counts as a performance cliff, which the FUZZ_MAX_SLOWDOWN
+ * environment variable overrides. The baseline is parsed by the same engine
+ * with the same options, so sanitizers and tiny chunks slow both down alike.
+ * Shorter inputs than MIN_TIMED_SIZE parse too quickly for timing them to mean
+ * anything.
+ */
+#define MAX_SLOWDOWN 20
+#define MIN_TIMED_SIZE 1024
+#define BASELINE_SIZE (8 << 10)
+
+/* the first byte of each input picks these, and the chunk size */
+enum {
+	OPT_PARTIAL = 1 << 0,
+	OPT_RELAXED = 1 << 1,
+	OPT_EXACT = 1 << 2,
+	OPT_LIMITS = 1 << 3
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int visit_nothing(const struct json_value *v, const char *name,
+                         int depth, void *data)
+{
+	(void)v;
+	(void)name;
+	(void)depth;
+	(void)data;
+	return 0;
+}
+
+/* reads the whole tree, so AddressSanitizer sees anything off in it */
+static void walk(const struct json_value *root)
+{
+	struct json_document *doc;
+
+	if (!root)
+		return;
+
+	json_visit(root, visit_nothing, NULL);
+	doc = json_compact(root);
+	if (doc) {
+		json_visit(json_document_root(doc), visit_nothing, NULL);
+		json_free_document(doc);
+	}
+}
+
+static void parse_recursive(struct json_parser *p, const char *str,
+                            size_t len, size_t chunk)
+{
+	(void)len;
+	(void)chunk;
+	walk(json_parse(p, str, NULL));
+}
+
+static void parse_steps(struct json_parser *p, const char *str, size_t len,
+                        size_t chunk)
+{
+	struct json_value *value;
+	(void)len;
+
+	json_parse_begin(p, str, NULL);
+	while (json_parse_step(p, chunk, &value))
+		;
+	walk(value);
+}
+
+static void parse_chunks(struct json_parser *p, const char *str, size_t len,
+                         size_t chunk)
+{
+	struct json_value *value;
+	size_t pos = 0, n;
+
+	json_parse_begin(p, NULL, NULL);
+	do {
+		n = len - pos < chunk ? len - pos : chunk;
+		pos += n;
+	} while (json_parse_feed(p, str + pos - n, n, &value));
+	walk(value);
+}
+
+static void walk_line(struct json_value *value, void *data)
+{
+	(void)data;
+	walk(value);
+}
+
+static void parse_lines(struct json_parser *p, const char *str, size_t len,
+                        size_t chunk)
+{
+	(void)len;
+	(void)chunk;
+	json_parse_lines(p, str, walk_line, NULL, NULL);
+}
+
+static void parse_sequence(struct json_parser *p, const char *str, size_t len,
+                           size_t chunk)
+{
+	struct json_value *value;
+	size_t offset = 0, prev;
+	(void)chunk;
+
+	do {
+		prev = offset;
+		value = json_parse_next(p, str, &offset, NULL);
+		walk(value);
+
+		if (value && offset <= prev) {
+			fprintf(stderr, "json_parse_next: stuck at offset %zu\n",
+			        offset);
+			abort();
+		}
+	} while (value && offset < len);
+}
+
+static void parse_batch(struct json_parser *p, const char *str, size_t len,
+                        size_t chunk)
+{
+	char *copy = malloc(len + 1), *line, *eol;
+	const char **strs = malloc(sizeof(*strs) * (len + 1));
+	struct json_value **roots = malloc(sizeof(*roots) * (len + 1));
+	size_t i, count = 0;
+	(void)chunk;
+
+	if (!copy || !strs || !roots)
+		abort();
+
+	memcpy(copy, str, len + 1);
+	for (line = copy; line; line = eol ? eol + 1 : NULL) {
+		eol = strchr(line, '\n');
+		if (eol)
+			*eol = '\0';
+		strs[count++] = line;
+	}
+
+	json_parse_batch(p, strs, count, roots, NULL);
+	for (i = 0; i < count; ++i)
+		walk(roots[i]);
+
+	free(roots);
+	free(strs);
+	free(copy);
+}
+
+/*
+ * The recursive engines get a depth limit, to keep the stack sane. The others
+ * keep their stack on the heap and go unlimited, so deep trees reach the code
+ * walking them too.
+ */
+#define RECURSIVE_MAX_DEPTH 1000
+
+static const struct engine {
+	const char *name;
+	void (*parse)(struct json_parser *p, const char *str, size_t len,
+	              size_t chunk);
+	size_t max_depth;
+} engines[] = {
+	{ "json_parse", parse_recursive, RECURSIVE_MAX_DEPTH },
+	{ "json_parse_step", parse_steps, 0 },
+	{ "json_parse_feed", parse_chunks, 0 },
+	{ "json_parse_lines", parse_lines, RECURSIVE_MAX_DEPTH },
+	{ "json_parse_next", parse_sequence, RECURSIVE_MAX_DEPTH },
+	{ "json_parse_batch", parse_batch, RECURSIVE_MAX_DEPTH }
+};
+
+static double time_engine(const struct engine *e, unsigned opts,
+                          const char *str, size_t len)
+{
+	struct json_parser *p = json_create_parser();
+	struct json_limits limits = { 0, 0, 0, e->max_depth };
+	unsigned flags = 0;
+	double start, elapsed;
+
+	/* tight limits now and then */
+	if (opts & OPT_LIMITS) {
+		limits.max_bytes = 64 << 10;
+		limits.max_nodes = 256;
+		limits.max_string_length = 64;
+		limits.max_depth = 16;
+	}
+	if (opts & OPT_PARTIAL)
+		flags |= JSON_PARTIAL_RESULTS;
+	if (opts & OPT_RELAXED)
+		flags |= JSON_RELAXED;
+	if (opts & OPT_EXACT)
+		flags |= JSON_EXACT_NUMBERS;
+	json_set_flags(p, flags);
+	json_set_limits(p, &limits);
+
+	start = now();
+	e->parse(p, str, len, (opts >> 4) + 1);
+	elapsed = now() - start;
+
+	json_destroy_parser(p);
+	return elapsed;
+}
+
+static double max_slowdown(void)
+{
+	static double limit;
+
+	if (!limit) {
+		const char *env = getenv("FUZZ_MAX_SLOWDOWN");
+		limit = env && atof(env) > 0 ? atof(env) : MAX_SLOWDOWN;
+	}
+	return limit;
+}
+
+/*
+ * A document that's costly to parse, but linearly so: nesting, escapes and
+ * numbers of every kind. It's all on one line, for the line-based engines.
+ */
+static const char *baseline_document(size_t *len)
+{
+	static const char record[] =
+	    "{\"k\\u00e9y\": [\"a\\n\\\"b\\\\c\", -1.5e-7, 12345678901234567890, "
+	    "true, null, {}], \"deep\": [[[[[[[[{\"x\": 0.5}]]]]]]]]}, ";
+	static char *doc;
+	static size_t doc_len;
+
+	if (!doc) {
+		size_t n = sizeof(record) - 1;
+
+		doc = malloc(BASELINE_SIZE + n + 3);
+		if (!doc)
+			abort();
+		doc[doc_len++] = '[';
+		while (doc_len < BASELINE_SIZE) {
+			memcpy(doc + doc_len, record, n);
+			doc_len += n;
+		}
+		memcpy(doc + doc_len, "0]", 3);
+		doc_len += 2;
+	}
+	*len = doc_len;
+	return doc;
+}
+
+/* seconds per byte for the baseline, by engine and options but the limits */
+static double baseline(size_t engine, unsigned opts)
+{
+	static double per_byte[sizeof(engines) / sizeof(*engines)][256];
+	double *ret = &per_byte[engine][opts & ~OPT_LIMITS];
+
+	if (!*ret) {
+		size_t len;
+		const char *doc = baseline_document(&len);
+		double a = time_engine(&engines[engine], opts & ~OPT_LIMITS,
+		                       doc, len);
+		double b = time_engine(&engines[engine], opts & ~OPT_LIMITS,
+		                       doc, len);
+
+		*ret = (a < b ? a : b) / len;
+	}
+	return *ret;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	unsigned opts;
+	size_t i, len;
+	char *str;
+
+	if (!size)
+		return 0;
+
+	/* the parsers want NUL-terminated strings */
+	opts = data[0];
+	str = malloc(size);
+	if (!str)
+		abort();
+	memcpy(str, data + 1, size - 1);
+	str[size - 1] = '\0';
+	len = strlen(str);
+
+	for (i = 0; i < sizeof(engines) / sizeof(*engines); ++i) {
+		double elapsed = time_engine(&engines[i], opts, str, len);
+		double limit;
+
+		if (len < MIN_TIMED_SIZE)
+			continue;
+
+		limit = max_slowdown() * baseline(i, opts) * len;
+		if (elapsed <= limit)
+			continue;
+
+		/* once more, in case something else got in the way */
+		elapsed = time_engine(&engines[i], opts, str, len);
+		if (elapsed > limit) {
+			fprintf(stderr, "%s: %.0f ns/byte over %zu bytes, "
+			        "%.1f times the baseline, limit %g\n",
+			        engines[i].name, elapsed * 1e9 / len, len,
+			        elapsed / (baseline(i, opts) * len),
+			        max_slowdown());
+			abort();
+		}
+	}
+
+	free(str);
+	return 0;
+}
+
+#ifdef FUZZ_REPLAY
+int main(int argc, char *argv[])
+{
+	int opt, i, prefix = 0;
+	unsigned long opts = 0;
+	char *end;
+
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		switch (opt) {
+		case 'o':
+			opts = strtoul(optarg, &end, 0);
+			if (*end || end == optarg || opts > UINT8_MAX) {
+				fprintf(stderr, "bad option byte: %s\n", optarg);
+				return 2;
+			}
+			prefix = 1;
+			break;
+
+		default:
+			fprintf(stderr, "usage: %s [-o option-byte] input...\n",
+			        argv[0]);
+			return 2;
+		}
+	}
+
+	for (i = optind; i < argc; ++i) {
+		FILE *fp = fopen(argv[i], "rb");
+		uint8_t *buf = NULL;
+		size_t len = prefix, size = 0;
+
+		if (!fp) {
+			perror(argv[i]);
+			return 1;
+		}
+		while (!feof(fp)) {
+			size = size ? size * 2 : 4096;
+			buf = realloc(buf, size);
+			if (!buf) {
+				perror("realloc");
+				return 1;
+			}
+			len += fread(buf + len, 1, size - len, fp);
+		}
+		fclose(fp);
+
+		if (prefix)
+			buf[0] = opts;
+		LLVMFuzzerTestOneInput(buf, len);
+		free(buf);
+	}
+	return 0;
+}
+#endif
@@ -0,0 +1,557 @@
+/*
+ * json-ingest: bulk-parse many JSON files, overlapping file I/O with parsing.
+ *
+ * Reads are kept in flight with io_uring where available (falling back to a
+ * pool of pread() threads), and completed buffers are handed to a pool of
+ * worker threads that each reuse a single parser.
+ */
+
+#include "json.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+struct job {
+	struct job *next;
+	const char *path;
+	char *buf;
+	size_t size, done;
+	int fd, error;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready, room;
+	struct job *head, **tail;
+	int in_flight, depth, closed;
+
+	const char **paths;
+	int num_paths, next_path;
+
+	int errors;
+	size_t bytes;
+} q = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+	.room = PTHREAD_COND_INITIALIZER,
+	.tail = &q.head
+};
+
+static __thread const char *current_path;
+
+static void error(int line, const char *str)
+{
+	printf("%s:%d: %s\n", current_path, line, str);
+}
+
+/* blocks until there's room for another buffer in memory */
+static void acquire_slot(void)
+{
+	pthread_mutex_lock(&q.lock);
+	while (q.in_flight >= q.depth)
+		pthread_cond_wait(&q.room, &q.lock);
+	++q.in_flight;
+	pthread_mutex_unlock(&q.lock);
+}
+
+static int try_acquire_slot(void)
+{
+	int ret = 0;
+	pthread_mutex_lock(&q.lock);
+	if (q.in_flight < q.depth) {
+		++q.in_flight;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&q.lock);
+	return ret;
+}
+
+static void release_slot(void)
+{
+	pthread_mutex_lock(&q.lock);
+	--q.in_flight;
+	pthread_cond_signal(&q.room);
+	pthread_mutex_unlock(&q.lock);
+}
+
+static const char *next_path(void)
+{
+	const char *ret = NULL;
+	pthread_mutex_lock(&q.lock);
+	if (q.next_path < q.num_paths)
+		ret = q.paths[q.next_path++];
+	pthread_mutex_unlock(&q.lock);
+	return ret;
+}
+
+static void push_job(struct job *job)
+{
+	if (job->fd >= 0)
+		close(job->fd);
+
+	job->next = NULL;
+	pthread_mutex_lock(&q.lock);
+	*q.tail = job;
+	q.tail = &job->next;
+	pthread_cond_signal(&q.ready);
+	pthread_mutex_unlock(&q.lock);
+}
+
+static struct job *pop_job(void)
+{
+	struct job *ret;
+	pthread_mutex_lock(&q.lock);
+	while (!q.head && !q.closed)
+		pthread_cond_wait(&q.ready, &q.lock);
+
+	ret = q.head;
+	if (ret) {
+		q.head = ret->next;
+		if (!q.head)
+			q.tail = &q.head;
+	}
+	pthread_mutex_unlock(&q.lock);
+	return ret;
+}
+
+static void close_queue(void)
+{
+	pthread_mutex_lock(&q.lock);
+	q.closed = 1;
+	pthread_cond_broadcast(&q.ready);
+	pthread_mutex_unlock(&q.lock);
+}
+
+/* opens the file and allocates its buffer; on failure the job is queued */
+static struct job *open_job(const char *path)
+{
+	struct stat st;
+	struct job *job = calloc(1, sizeof(*job));
+	if (!job) {
+		perror("calloc");
+		exit(1);
+	}
+	job->path = path;
+
+	job->fd = open(path, O_RDONLY);
+	if (job->fd < 0 || fstat(job->fd, &st) < 0) {
+		job->error = errno;
+		push_job(job);
+		return NULL;
+	}
+
+	job->size = st.st_size;
+	job->buf = malloc(job->size + 1);
+	if (!job->buf) {
+		job->error = errno;
+		push_job(job);
+		return NULL;
+	}
+
+	if (!job->size) {
+		push_job(job);
+		return NULL;
+	}
+
+	return job;
+}
+
+static void *pread_thread(void *arg)
+{
+	const char *path;
+	(void)arg;
+
+	while ((path = next_path()) != NULL) {
+		struct job *job;
+
+		acquire_slot();
+		job = open_job(path);
+		if (!job)
+			continue;
+
+		while (job->done < job->size) {
+			ssize_t ret = pread(job->fd, job->buf + job->done,
+			                    job->size - job->done, job->done);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				job->error = errno;
+				break;
+			}
+			if (!ret)
+				break; /* file shrunk */
+			job->done += ret;
+		}
+		push_job(job);
+	}
+	return NULL;
+}
+
+#ifdef USE_IO_URING
+
+struct ring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned entries, to_submit, pending;
+};
+
+/* IORING_OP_READ came with kernel 5.6, as did probing for it */
+static int ring_supports(int fd, unsigned op)
+{
+	struct io_uring_probe *probe;
+	size_t size = sizeof(*probe) + 256 * sizeof(probe->ops[0]);
+	int ret;
+
+	probe = calloc(1, size);
+	if (!probe)
+		return 0;
+
+	ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+	              probe, 256) == 0 && op <= probe->last_op &&
+	      op < probe->ops_len &&
+	      (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ret;
+}
+
+static int ring_setup(struct ring *r, unsigned entries)
+{
+	struct io_uring_params params;
+	size_t sq_size, cq_size;
+	char *sq, *cq;
+
+	memset(&params, 0, sizeof(params));
+	r->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (r->fd < 0)
+		return -1;
+	if (!ring_supports(r->fd, IORING_OP_READ))
+		goto err;
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes +
+	          params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+	          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto err;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		cq = sq;
+	else {
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+		          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto err;
+	}
+
+	r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+	               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err;
+
+	r->sq_head = (unsigned *)(sq + params.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + params.sq_off.array);
+	r->cq_head = (unsigned *)(cq + params.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	r->entries = params.sq_entries;
+	r->to_submit = r->pending = 0;
+	return 0;
+
+err:
+	close(r->fd);
+	return -1;
+}
+
+static void ring_read(struct ring *r, struct job *job)
+{
+	unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	size_t len = job->size - job->done;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = job->fd;
+	sqe->off = job->done;
+	sqe->addr = (unsigned long)(job->buf + job->done);
+	sqe->len = len > (1u << 30) ? (1u << 30) : len;
+	sqe->user_data = (unsigned long)job;
+	r->sq_array[idx] = idx;
+
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++r->to_submit;
+	++r->pending;
+}
+
+static int ring_enter(struct ring *r, unsigned min_complete)
+{
+	int ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit,
+	                  min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return 0;
+		return -1;
+	}
+	r->to_submit -= ret;
+	return 0;
+}
+
+static void ring_reap(struct ring *r)
+{
+	unsigned head = *r->cq_head;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+		struct job *job = (struct job *)(unsigned long)cqe->user_data;
+
+		--r->pending;
+		if (cqe->res < 0)
+			job->error = -cqe->res;
+		else
+			job->done += cqe->res;
+
+		if (!job->error && cqe->res > 0 && job->done < job->size)
+			ring_read(r, job);
+		else
+			push_job(job);
+
+		++head;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_reader(void)
+{
+	struct ring r;
+	const char *path = NULL;
+
+	if (ring_setup(&r, q.depth) < 0)
+		return -1;
+
+	while (1) {
+		/* queue up reads while there's room for them */
+		while (r.pending < r.entries) {
+			struct job *job;
+
+			if (!path)
+				path = next_path();
+			if (!path || !try_acquire_slot())
+				break;
+
+			job = open_job(path);
+			path = NULL;
+			if (job)
+				ring_read(&r, job);
+		}
+
+		if (!r.pending) {
+			if (!path)
+				break;
+
+			/* all buffers are waiting to be parsed */
+			acquire_slot();
+			release_slot();
+			continue;
+		}
+
+		if (ring_enter(&r, 1) < 0) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+		ring_reap(&r);
+	}
+
+	close(r.fd);
+	return 0;
+}
+
+#else
+
+static int uring_reader(void)
+{
+	return -1;
+}
+
+#endif
+
+static void *worker_thread(void *arg)
+{
+	struct json_parser *p = json_create_parser();
+	struct job *job;
+	(void)arg;
+
+	if (!p) {
+		perror("json_create_parser");
+		exit(1);
+	}
+
+	while ((job = pop_job()) != NULL) {
+		int failed = 0;
+
+		current_path = job->path;
+		if (job->error) {
+			printf("%s: %s\n", job->path, strerror(job->error));
+			failed = 1;
+		} else {
+			job->buf[job->done] = '\0';
+			failed = !json_parse(p, job->buf, error);
+			json_reset_parser(p);
+		}
+
+		pthread_mutex_lock(&q.lock);
+		q.errors += failed;
+		q.bytes += job->done;
+		pthread_mutex_unlock(&q.lock);
+
+		free(job->buf);
+		free(job);
+		release_slot();
+	}
+
+	json_destroy_parser(p);
+	return NULL;
+}
+
+static const char **read_paths(FILE *fp, int *num_paths)
+{
+	const char **ret = NULL;
+	char *line = NULL;
+	size_t line_size = 0;
+	int num = 0, alloc = 0;
+	ssize_t len;
+
+	while ((len = getline(&line, &line_size, fp)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!len)
+			continue;
+
+		if (num == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			ret = realloc(ret, sizeof(*ret) * alloc);
+			if (!ret) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		ret[num] = strdup(line);
+		if (!ret[num++]) {
+			perror("strdup");
+			exit(1);
+		}
+	}
+	free(line);
+
+	*num_paths = num;
+	return ret;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-j workers] [-d depth] [-P] [file...]\n"
+	                "reads the list of files from stdin if none are given\n",
+	        argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t *workers, readers[4];
+	int num_workers = sysconf(_SC_NPROCESSORS_ONLN), use_pread = 0;
+	int opt, i;
+	const char *method = "io_uring";
+	struct timespec start, end;
+	double elapsed;
+
+	q.depth = 0;
+	while ((opt = getopt(argc, argv, "j:d:P")) != -1) {
+		switch (opt) {
+		case 'j':
+			num_workers = atoi(optarg);
+			break;
+
+		case 'd':
+			q.depth = atoi(optarg);
+			if (q.depth <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'P':
+			use_pread = 1;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (num_workers <= 0)
+		num_workers = 1;
+	if (!q.depth)
+		q.depth = 4 * num_workers;
+
+	if (optind < argc) {
+		q.paths = (const char **)argv + optind;
+		q.num_paths = argc - optind;
+	} else
+		q.paths = read_paths(stdin, &q.num_paths);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	workers = malloc(sizeof(*workers) * num_workers);
+	if (!workers) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < num_workers; ++i)
+		pthread_create(&workers[i], NULL, worker_thread, NULL);
+
+	if (use_pread || uring_reader() < 0) {
+		method = "pread";
+		for (i = 0; i < 4; ++i)
+			pthread_create(&readers[i], NULL, pread_thread, NULL);
+		for (i = 0; i < 4; ++i)
+			pthread_join(readers[i], NULL);
+	}
+
+	close_queue();
+	for (i = 0; i < num_workers; ++i)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) +
+	          (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+	fprintf(stderr, "%d files, %zu bytes, %d errors, %.1f MB/s (%s)\n",
+	        q.num_paths, q.bytes, q.errors,
+	        q.bytes / (elapsed > 0 ? elapsed : 1e-9) / 1e6, method);
+
+	return q.errors ? 1 : 0;
+}
@@ -3,7 +3,9 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <float.h>
 #include <limits.h>
+#include <math.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -12,31 +14,542 @@
 #include <stdlib.h>
 #include <string.h>
 
-struct alloc {
-	struct alloc *prev, *next;
-	char data[0];
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define HAVE_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+
+#ifdef JSON_COUNT_ALLOCS
+/*
+ * Allocation-counting build, for make check to bound the allocations each
+ * test makes. Every malloc(), realloc() and mmap() below goes through these.
+ * The parser and document structs count as calls but not bytes, as their
+ * size depends on the platform's jmp_buf and such.
+ */
+static size_t alloc_calls, alloc_bytes;
+
+static void count_alloc(size_t size)
+{
+	__atomic_add_fetch(&alloc_calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+static void *count_malloc(size_t size)
+{
+	count_alloc(size);
+	return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size)
+{
+	count_alloc(size);
+	return realloc(ptr, size);
+}
+
+static void *count_struct_malloc(size_t size)
+{
+	count_alloc(0);
+	return malloc(size);
+}
+
+#define malloc(size) count_malloc(size)
+#define realloc(ptr, size) count_realloc(ptr, size)
+#define struct_malloc(size) count_struct_malloc(size)
+#ifdef __linux__
+#define mmap(addr, len, prot, flags, fd, off) \
+	(count_alloc(len), mmap(addr, len, prot, flags, fd, off))
+#endif
+#else
+#define struct_malloc(size) malloc(size)
+#endif
+
+/*
+ * Scanning kernels, picked for the CPU at json_create_parser() time. They
+ * stop at the input's NUL terminator at the latest, but vector versions load
+ * whole aligned blocks, which can reach past it (though never into another
+ * page), so they're hidden from AddressSanitizer.
+ */
+struct kernels {
+	const char *name;
+	int (*supported)(void);
+
+	/* the length of the run at str without quotes, '\\' or controls */
+	size_t (*scan_string)(const char *str, char quote);
+
+	/* skips spaces and tabs */
+	const char *(*skip_blanks)(const char *str);
+
+	/* the length of the run of decimal digits at str */
+	size_t (*scan_digits)(const char *str);
+};
+
+static size_t scan_string_scalar(const char *str, char quote)
+{
+	const char *s = str;
+	while (*s != quote && *s != '\\' && (unsigned char)*s >= 0x20)
+		++s;
+	return s - str;
+}
+
+static const char *skip_blanks_scalar(const char *str)
+{
+	while (*str == ' ' || *str == '\t')
+		++str;
+	return str;
+}
+
+static size_t scan_digits_scalar(const char *str)
+{
+	const char *s = str;
+	while (isdigit(*s))
+		++s;
+	return s - str;
+}
+
+static const struct kernels scalar_kernels = {
+	"scalar", NULL, scan_string_scalar, skip_blanks_scalar,
+	scan_digits_scalar
+};
+
+#define VECTOR_KERNEL __attribute__((no_sanitize_address))
+
+#ifdef HAVE_X86_KERNELS
+static int sse2_supported(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+__attribute__((target("sse2"))) VECTOR_KERNEL
+static size_t scan_string_sse2(const char *str, char quote)
+{
+	const char *s = (const char *)((uintptr_t)str & ~(uintptr_t)15);
+	const __m128i q = _mm_set1_epi8(quote), bs = _mm_set1_epi8('\\');
+	const __m128i ctl = _mm_set1_epi8(0x1f);
+	unsigned mask = ~0u << (str - s);
+
+	while (1) {
+		__m128i v = _mm_load_si128((const __m128i *)s);
+		__m128i hit = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, q), _mm_cmpeq_epi8(v, bs)),
+		    _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v));
+		unsigned bits = _mm_movemask_epi8(hit) & mask;
+
+		if (bits)
+			return s + __builtin_ctz(bits) - str;
+		s += 16;
+		mask = ~0u;
+	}
+}
+
+__attribute__((target("sse2"))) VECTOR_KERNEL
+static const char *skip_blanks_sse2(const char *str)
+{
+	const char *s = (const char *)((uintptr_t)str & ~(uintptr_t)15);
+	const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+	unsigned mask = 0xffff & (~0u << (str - s));
+
+	while (1) {
+		__m128i v = _mm_load_si128((const __m128i *)s);
+		__m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, sp),
+		                             _mm_cmpeq_epi8(v, tab));
+		unsigned bits = ~_mm_movemask_epi8(blank) & mask;
+
+		if (bits)
+			return s + __builtin_ctz(bits);
+		s += 16;
+		mask = 0xffff;
+	}
+}
+
+__attribute__((target("sse2"))) VECTOR_KERNEL
+static size_t scan_digits_sse2(const char *str)
+{
+	const char *s = (const char *)((uintptr_t)str & ~(uintptr_t)15);
+	const __m128i zero = _mm_set1_epi8('0'), nine = _mm_set1_epi8(9);
+	unsigned mask = 0xffff & (~0u << (str - s));
+
+	while (1) {
+		__m128i v = _mm_sub_epi8(_mm_load_si128((const __m128i *)s), zero);
+		__m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(v, nine), v);
+		unsigned bits = ~_mm_movemask_epi8(digit) & mask;
+
+		if (bits)
+			return s + __builtin_ctz(bits) - str;
+		s += 16;
+		mask = 0xffff;
+	}
+}
+
+static const struct kernels sse2_kernels = {
+	"sse2", sse2_supported, scan_string_sse2, skip_blanks_sse2,
+	scan_digits_sse2
+};
+
+static int avx2_supported(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2"))) VECTOR_KERNEL
+static size_t scan_string_avx2(const char *str, char quote)
+{
+	const char *s = (const char *)((uintptr_t)str & ~(uintptr_t)31);
+	const __m256i q = _mm256_set1_epi8(quote), bs = _mm256_set1_epi8('\\');
+	const __m256i ctl = _mm256_set1_epi8(0x1f);
+	unsigned mask = ~0u << (str - s);
+
+	while (1) {
+		__m256i v = _mm256_load_si256((const __m256i *)s);
+		__m256i hit = _mm256_or_si256(
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, q),
+		                    _mm256_cmpeq_epi8(v, bs)),
+		    _mm256_cmpeq_epi8(_mm256_min_epu8(v, ctl), v));
+		unsigned bits = _mm256_movemask_epi8(hit) & mask;
+
+		if (bits)
+			return s + __builtin_ctz(bits) - str;
+		s += 32;
+		mask = ~0u;
+	}
+}
+
+__attribute__((target("avx2"))) VECTOR_KERNEL
+static const char *skip_blanks_avx2(const char *str)
+{
+	const char *s = (const char *)((uintptr_t)str & ~(uintptr_t)31);
+	const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+	unsigned mask = ~0u << (str - s);
+
+	while (1) {
+		__m256i v = _mm256_load_si256((const __m256i *)s);
+		__m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+		                                 _mm256_cmpeq_epi8(v, tab));
+		unsigned bits = ~(unsigned)_mm256_movemask_epi8(blank) & mask;
+
+		if (bits)
+			return s + __builtin_ctz(bits);
+		s += 32;
+		mask = ~0u;
+	}
+}
+
+static const struct kernels avx2_kernels = {
+	"avx2", avx2_supported, scan_string_avx2, skip_blanks_avx2,
+	scan_digits_sse2
+};
+
+static int avx512_supported(void)
+{
+	return __builtin_cpu_supports("avx512bw");
+}
+
+__attribute__((target("avx512bw"))) VECTOR_KERNEL
+static size_t scan_string_avx512(const char *str, char quote)
+{
+	const char *s = (const char *)((uintptr_t)str & ~(uintptr_t)63);
+	const __m512i q = _mm512_set1_epi8(quote), bs = _mm512_set1_epi8('\\');
+	const __m512i ctl = _mm512_set1_epi8(0x1f);
+	uint64_t mask = ~(uint64_t)0 << (str - s);
+
+	while (1) {
+		__m512i v = _mm512_load_si512((const void *)s);
+		uint64_t bits = (_mm512_cmpeq_epi8_mask(v, q) |
+		                 _mm512_cmpeq_epi8_mask(v, bs) |
+		                 _mm512_cmple_epu8_mask(v, ctl)) & mask;
+
+		if (bits)
+			return s + __builtin_ctzll(bits) - str;
+		s += 64;
+		mask = ~(uint64_t)0;
+	}
+}
+
+__attribute__((target("avx512bw"))) VECTOR_KERNEL
+static const char *skip_blanks_avx512(const char *str)
+{
+	const char *s = (const char *)((uintptr_t)str & ~(uintptr_t)63);
+	const __m512i sp = _mm512_set1_epi8(' '), tab = _mm512_set1_epi8('\t');
+	uint64_t mask = ~(uint64_t)0 << (str - s);
+
+	while (1) {
+		__m512i v = _mm512_load_si512((const void *)s);
+		uint64_t bits = ~(_mm512_cmpeq_epi8_mask(v, sp) |
+		                  _mm512_cmpeq_epi8_mask(v, tab)) & mask;
+
+		if (bits)
+			return s + __builtin_ctzll(bits);
+		s += 64;
+		mask = ~(uint64_t)0;
+	}
+}
+
+static const struct kernels avx512_kernels = {
+	"avx512", avx512_supported, scan_string_avx512, skip_blanks_avx512,
+	scan_digits_sse2
+};
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+/* NEON has no movemask, so narrow each byte of a comparison to a nibble */
+static inline uint64_t neon_mask(uint8x16_t cmp)
+{
+	uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+}
+
+VECTOR_KERNEL
+static size_t scan_string_neon(const char *str, char quote)
+{
+	const char *s = (const char *)((uintptr_t)str & ~(uintptr_t)15);
+	const uint8x16_t q = vdupq_n_u8(quote), bs = vdupq_n_u8('\\');
+	const uint8x16_t ctl = vdupq_n_u8(0x1f);
+	uint64_t mask = ~(uint64_t)0 << 4 * (str - s);
+
+	while (1) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)s);
+		uint8x16_t hit = vorrq_u8(vorrq_u8(vceqq_u8(v, q), vceqq_u8(v, bs)),
+		                          vcleq_u8(v, ctl));
+		uint64_t bits = neon_mask(hit) & mask;
+
+		if (bits)
+			return s + (__builtin_ctzll(bits) >> 2) - str;
+		s += 16;
+		mask = ~(uint64_t)0;
+	}
+}
+
+VECTOR_KERNEL
+static const char *skip_blanks_neon(const char *str)
+{
+	const char *s = (const char *)((uintptr_t)str & ~(uintptr_t)15);
+	const uint8x16_t sp = vdupq_n_u8(' '), tab = vdupq_n_u8('\t');
+	uint64_t mask = ~(uint64_t)0 << 4 * (str - s);
+
+	while (1) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)s);
+		uint8x16_t other = vmvnq_u8(vorrq_u8(vceqq_u8(v, sp),
+		                                     vceqq_u8(v, tab)));
+		uint64_t bits = neon_mask(other) & mask;
+
+		if (bits)
+			return s + (__builtin_ctzll(bits) >> 2);
+		s += 16;
+		mask = ~(uint64_t)0;
+	}
+}
+
+VECTOR_KERNEL
+static size_t scan_digits_neon(const char *str)
+{
+	const char *s = (const char *)((uintptr_t)str & ~(uintptr_t)15);
+	const uint8x16_t zero = vdupq_n_u8('0'), nine = vdupq_n_u8(9);
+	uint64_t mask = ~(uint64_t)0 << 4 * (str - s);
+
+	while (1) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)s);
+		uint8x16_t other = vcgtq_u8(vsubq_u8(v, zero), nine);
+		uint64_t bits = neon_mask(other) & mask;
+
+		if (bits)
+			return s + (__builtin_ctzll(bits) >> 2) - str;
+		s += 16;
+		mask = ~(uint64_t)0;
+	}
+}
+
+/* NEON is part of the AArch64 baseline, so there's nothing to check */
+static const struct kernels neon_kernels = {
+	"neon", NULL, scan_string_neon, skip_blanks_neon, scan_digits_neon
+};
+#endif
+
+/* best first */
+static const struct kernels *const all_kernels[] = {
+#ifdef HAVE_X86_KERNELS
+	&avx512_kernels,
+	&avx2_kernels,
+	&sse2_kernels,
+#endif
+#ifdef HAVE_NEON_KERNELS
+	&neon_kernels,
+#endif
+	&scalar_kernels
+};
+
+/*
+ * The best kernels the CPU supports, unless JSON_LOL_KERNELS names others,
+ * for testing each of them on one machine.
+ */
+static const struct kernels *select_kernels(void)
+{
+	const char *name = getenv("JSON_LOL_KERNELS");
+	size_t i;
+
+	for (i = 0; name && i < ARRAY_SIZE(all_kernels); ++i) {
+		const struct kernels *k = all_kernels[i];
+		if (!strcmp(name, k->name) && (!k->supported || k->supported()))
+			return k;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(all_kernels); ++i) {
+		const struct kernels *k = all_kernels[i];
+		if (!k->supported || k->supported())
+			return k;
+	}
+	return &scalar_kernels;
+}
+
+/*
+ * Values are bump-allocated from a list of blocks, newest first. Blocks
+ * start out small and double in size, while allocations too big for a
+ * regular block get a block of their own.
+ */
+struct block {
+	struct block *next;
+	size_t size, used;
+	int mmapped;
+};
+
+#define ALIGN(x) (((x) + 7) & ~(size_t)7)
+#define BLOCK_HEADER ALIGN(sizeof(struct block))
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (2 << 20)
+#define HUGE_PAGE_SIZE (2 << 20)
+
+struct json_document {
+	struct block *blocks;
+	struct json_value *root;
+	unsigned long refs;
+};
+
+struct arena_mark {
+	struct block *block;
+	size_t used;
+};
+
+/* children of open containers, moved to the arena once complete */
+union slot {
+	const char *name;
+	struct json_value *value;
+};
+
+struct frame {
+	struct json_value *value;
+	size_t base;
 };
 
 struct json_parser {
 	const char *str;
+	const struct kernels *kernels;
 	jmp_buf jmp;
 	char error[1024];
+	enum json_error error_code;
 	int line;
 	unsigned char skip_space : 1;
-	struct alloc *alloc_head;
+	unsigned char single_line : 1; /* newlines end values */
+	unsigned char relaxed : 1; /* JSON_RELAXED, for the recursive parser */
+	unsigned flags;
+
+	struct block *blocks;
+	size_t block_size;
+	struct json_value *last; /* most recently returned value */
+
+	/* limits, with zero mapped to the maximum representable value */
+	size_t max_bytes, max_nodes, max_string_length;
+	int max_depth;
+	size_t arena_bytes, nodes;
+
+	/* where the current parse started, for rolling back on errors */
+	struct arena_mark start;
+
+	union slot *scratch;
+	size_t scratch_len, scratch_size;
+
+	/* state for json_parse_step() */
+	void (*err)(int, const char *);
+	enum {
+		STATE_IDLE,
+		STATE_VALUE,
+		STATE_NAME,
+		STATE_NEXT,
+		STATE_END
+	} state;
+	struct frame *stack;
+	int depth, stack_size;
+	struct json_value *root;
+
+	/* state for json_parse_feed() */
+	const char *end, *mark;
+	char *input;
+	size_t input_size, retry_len;
+	int eof, mark_line;
+	size_t mark_scratch, mark_nodes;
+	struct arena_mark mark_arena;
+	/* state for json_parse_next() */
+	int next_line;
 };
 
+/*
+ * When parsing chunked input, running into the end of the buffered input
+ * means we need to wait for more, rather than that the input is truncated.
+ */
+static void check_input(struct json_parser *p)
+{
+	if (p->str == p->end && !p->eof)
+		longjmp(p->jmp, 1);
+}
+
+static void parse_error(struct json_parser *p, const char *fmt, ...);
+
+/* returns where the comment at str ends, or NULL if there's none */
+static const char *skip_comment(struct json_parser *p, const char *str)
+{
+	if (str[1] == '/') {
+		/* the line break is left for skip_space() to count */
+		for (str += 2; *str && *str != '\n' && *str != '\r'; ++str)
+			;
+		return str;
+	}
+
+	if (str[1] != '*')
+		return NULL;
+
+	for (str += 2; *str; ++str) {
+		if (str[0] == '*' && str[1] == '/')
+			return str + 2;
+		if (*str == '\n' || (*str == '\r' && str[1] != '\n'))
+			p->line++;
+	}
+	p->str = str;
+	parse_error(p, "unterminated comment");
+	return NULL;
+}
+
 static void skip_space(struct json_parser *p)
 {
-	const char *str = p->str;
+	const char *str = p->str, *tmp;
 	while (1) {
 		switch (*str) {
 		case '\n':
+			if (p->single_line)
+				goto done;
 			p->line++;
 			++str;
 			break;
 
 		case '\r':
+			if (p->single_line)
+				goto done;
 			p->line++;
 			++str;
 			if (*str == '\n')
@@ -45,66 +558,269 @@ static void skip_space(struct json_parser *p)
 
 		case '\t':
 		case ' ':
-			++str;
+			/* runs of them are indentation, worth a kernel call */
+			if (str[1] == ' ' || str[1] == '\t')
+				str = p->kernels->skip_blanks(str + 2);
+			else
+				++str;
+			break;
+
+		case '/':
+			/* never reached by valid strict input */
+			if (!p->relaxed || !(tmp = skip_comment(p, str)))
+				goto done;
+			str = tmp;
 			break;
 
 		default:
-			p->str = str;
-			return;
+			goto done;
 		}
 	}
+done:
+	p->str = str;
 }
 
 static void parse_error(struct json_parser *p, const char *fmt, ...)
 {
 	va_list va;
+	check_input(p);
+
 	va_start(va, fmt);
 	vsnprintf(p->error, sizeof(p->error), fmt, va);
 	va_end(va);
+	p->error_code = JSON_ERROR_SYNTAX;
 	longjmp(p->jmp, -1);
 }
 
-static void *mem_alloc(struct json_parser *p, size_t size)
+static void memory_error(struct json_parser *p, const char *fmt, ...)
+{
+	va_list va;
+	va_start(va, fmt);
+	vsnprintf(p->error, sizeof(p->error), fmt, va);
+	va_end(va);
+	p->error_code = JSON_ERROR_MEMORY;
+	longjmp(p->jmp, -1);
+}
+
+static void limit_error(struct json_parser *p, const char *fmt, ...)
+{
+	va_list va;
+	va_start(va, fmt);
+	vsnprintf(p->error, sizeof(p->error), fmt, va);
+	va_end(va);
+	p->error_code = JSON_ERROR_LIMIT;
+	longjmp(p->jmp, -1);
+}
+
+#if defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE)
+static struct block *huge_block(size_t *size)
+{
+	size_t len = (*size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+	struct block *b = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	b = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+#ifdef MADV_HUGEPAGE
+	if (b == MAP_FAILED) {
+		/*
+		 * No reserved huge pages, fall back to transparent ones. Those
+		 * need the mapping to be aligned, so over-allocate and trim.
+		 */
+		char *raw = mmap(NULL, len + HUGE_PAGE_SIZE,
+		                 PROT_READ | PROT_WRITE,
+		                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		char *mem;
+		if (raw == MAP_FAILED)
+			return NULL;
+
+		mem = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) &
+		               ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+		if (mem != raw)
+			munmap(raw, mem - raw);
+		munmap(mem + len, raw + HUGE_PAGE_SIZE - mem);
+
+		madvise(mem, len, MADV_HUGEPAGE);
+		b = (struct block *)mem;
+	}
+#endif
+	if (b == MAP_FAILED)
+		return NULL;
+
+	b->mmapped = 1;
+	*size = len;
+	return b;
+}
+#endif
+
+static void free_block(struct block *b)
+{
+#ifdef __linux__
+	if (b->mmapped) {
+		munmap(b, b->size);
+		return;
+	}
+#endif
+	free(b);
+}
+
+static void free_blocks(struct block *b)
+{
+	while (b) {
+		struct block *next = b->next;
+		free_block(b);
+		b = next;
+	}
+}
+
+static size_t initial_block_size(struct json_parser *p)
 {
-	struct alloc *a;
+	return p->flags & JSON_HUGE_PAGES ? HUGE_PAGE_SIZE : MIN_BLOCK_SIZE;
+}
+
+static struct block *new_block(struct json_parser *p, size_t size)
+{
+	struct block *b = NULL;
+	size_t block_size = p->block_size, avail;
+
+	if (size > SIZE_MAX - BLOCK_HEADER - HUGE_PAGE_SIZE)
+		memory_error(p, "too large allocation");
+
+	/* the limit may have been lowered below what a reused parser holds */
+	if (p->arena_bytes >= p->max_bytes)
+		limit_error(p, "too much memory used (limit %zu bytes)",
+		            p->max_bytes);
+	avail = p->max_bytes - p->arena_bytes;
+
+	size += BLOCK_HEADER;
+	if (block_size < size)
+		block_size = size;
+	else if (p->block_size < MAX_BLOCK_SIZE)
+		p->block_size *= 2;
+
+	if (size > avail)
+		limit_error(p, "too much memory used (limit %zu bytes)",
+		            p->max_bytes);
+
+	/* the request fits, so make do with what's left of the budget */
+	if (block_size > avail)
+		block_size = avail;
+
+#if defined(MAP_HUGETLB) || defined(MADV_HUGEPAGE)
+	/* huge pages round the block up, which may not fit anymore */
+	if ((p->flags & JSON_HUGE_PAGES) &&
+	    ((block_size + HUGE_PAGE_SIZE - 1) &
+	     ~(size_t)(HUGE_PAGE_SIZE - 1)) <= avail)
+		b = huge_block(&block_size);
+#endif
+	if (!b) {
+		b = malloc(block_size);
+		if (!b)
+			memory_error(p, "malloc failed: %s", strerror(errno));
+		b->mmapped = 0;
+	}
 
-	if (size > SIZE_MAX - sizeof(struct alloc))
-		parse_error(p, "too large allocation");
+	b->size = block_size;
+	b->used = BLOCK_HEADER;
+	b->next = p->blocks;
+	p->blocks = b;
+	p->arena_bytes += b->size;
+	return b;
+}
+
+static void *mem_alloc(struct json_parser *p, size_t size)
+{
+	struct block *b = p->blocks;
+	void *ret;
 
-	a = malloc(sizeof(struct alloc) + size);
-	if (!a)
-		parse_error(p, "malloc failed: %s", strerror(errno));
+	if (size > SIZE_MAX / 2)
+		memory_error(p, "too large allocation");
 
-	a->prev = NULL;
-	a->next = p->alloc_head;
-	if (p->alloc_head)
-		p->alloc_head->prev = a;
-	p->alloc_head = a;
+	size = ALIGN(size);
+	if (!b || b->size - b->used < size)
+		b = new_block(p, size);
 
-	return &a->data;
+	ret = (char *)b + b->used;
+	b->used += size;
+	return ret;
 }
 
-static void *mem_realloc(struct json_parser *p, void *ptr, size_t size)
+/* grows ptr in place if it's the most recent allocation, copies otherwise */
+static void *mem_realloc(struct json_parser *p, void *ptr, size_t old_size,
+                         size_t size)
 {
-	struct alloc *a, *new;
+	struct block *b = p->blocks;
+	void *ret;
 
 	if (!ptr)
 		return mem_alloc(p, size);
 
-	a = ptr - offsetof(struct alloc, data);
+	if (size > SIZE_MAX / 2)
+		memory_error(p, "too large allocation");
+
+	old_size = ALIGN(old_size);
+	size = ALIGN(size);
+	if ((char *)ptr + old_size == (char *)b + b->used &&
+	    size - old_size <= b->size - b->used) {
+		b->used += size - old_size;
+		return ptr;
+	}
+
+	ret = mem_alloc(p, size);
+	memcpy(ret, ptr, old_size);
+	return ret;
+}
+
+static void arena_mark(struct json_parser *p, struct arena_mark *m)
+{
+	m->block = p->blocks;
+	m->used = p->blocks ? p->blocks->used : 0;
+}
+
+/* frees everything allocated since the mark was taken */
+static void arena_rollback(struct json_parser *p, const struct arena_mark *m)
+{
+	while (p->blocks != m->block) {
+		struct block *b = p->blocks;
+
+		/*
+		 * Marked before there was any block, so keep the first one
+		 * for next time, like json_reset_parser() does. Otherwise
+		 * each line of json_parse_lines() allocates a block, each
+		 * twice as big as the one before.
+		 */
+		if (!b->next && b->size <= MAX_BLOCK_SIZE) {
+			b->used = BLOCK_HEADER;
+			return;
+		}
+
+		p->blocks = b->next;
+		p->arena_bytes -= b->size;
+		free_block(b);
+	}
+	if (p->blocks)
+		p->blocks->used = m->used;
+}
+
+static union slot *push_slot(struct json_parser *p)
+{
+	if (p->scratch_len == p->scratch_size) {
+		union slot *tmp;
+		size_t size = p->scratch_size ? p->scratch_size * 2 : 64;
+
+		if (p->scratch_size > SIZE_MAX / 2 / sizeof(*tmp))
+			limit_error(p, "too big container");
 
-	new = realloc(a, sizeof(struct alloc) + size);
-	if (!new)
-		parse_error(p, "realloc failed: %s", strerror(errno));
+		tmp = realloc(p->scratch, sizeof(*tmp) * size);
+		if (!tmp)
+			memory_error(p, "realloc failed: %s", strerror(errno));
 
-	if (new->next)
-		new->next->prev = new;
-	if (new->prev)
-		new->prev->next = new;
-	if (p->alloc_head == a)
-		p->alloc_head = new;
+		p->scratch = tmp;
+		p->scratch_size = size;
+	}
 
-	return &new->data;
+	return &p->scratch[p->scratch_len++];
 }
 
 static char next(struct json_parser *p)
@@ -172,6 +888,11 @@ static unsigned int parse_escaped_char(struct json_parser *p)
 	case '"': ch = '"'; break;
 	case '\\': ch = '\\'; break;
 	case '/': ch = '/'; break;
+	case '\'':
+		if (!p->relaxed)
+			unexpected_token(p);
+		ch = '\'';
+		break;
 	case 'b': ch = '\b'; break;
 	case 'f': ch = '\f'; break;
 	case 'n': ch = '\n'; break;
@@ -216,14 +937,49 @@ static int encode_utf8(char *dst, unsigned int *src, int len)
 	return ret;
 }
 
-static const char *parse_raw_string(struct json_parser *p)
+static struct json_value *new_value(struct json_parser *p, int type)
+{
+	struct json_value *ret;
+
+	if (++p->nodes > p->max_nodes)
+		limit_error(p, "too many values (limit %zu)", p->max_nodes);
+
+	ret = mem_alloc(p, sizeof(*ret));
+	ret->type = type;
+	return ret;
+}
+
+/* makes room for need more bytes, plus termination */
+static char *grow_string(struct json_parser *p, char *str, size_t *alloc,
+                         size_t len, size_t need)
+{
+	size_t size = *alloc;
+
+	if (len + need <= size - 1)
+		return str;
+
+	while (len + need > size - 1) {
+		if (size > SIZE_MAX / 3 || len > p->max_string_length)
+			limit_error(p, "too long string");
+		size = (size * 3) >> 1; /* grow by 150% */
+	}
+
+	str = mem_realloc(p, str, *alloc, size);
+	*alloc = size;
+	return str;
+}
+
+/* inlined into each caller, so strict strings compare against a constant */
+static inline __attribute__((always_inline))
+const char *parse_quoted(struct json_parser *p, char quote)
 {
-	size_t alloc = 16, len = 0;
+	size_t alloc = 16, len = 0, run;
 	char *ret = mem_alloc(p, alloc);
 
-	expect(p, '"');
+	/* before the quote is consumed, to keep leading whitespace */
 	p->skip_space = 0;
-	while (next(p) != '"') {
+	expect(p, quote);
+	while (next(p) != quote) {
 		unsigned int buf[2], chars = 1;
 		switch (next(p)) {
 		case '\\':
@@ -249,23 +1005,27 @@ static const char *parse_raw_string(struct json_parser *p)
 			break;
 
 		default:
-			if (iscntrl(next(p)))
-				unexpected_token(p);
-			buf[0] = consume(p);
+			/* copy a run of plain characters in one go */
+			run = p->kernels->scan_string(p->str, quote);
+			if (!run)
+				unexpected_token(p); /* a control character */
+			if (len + run > p->max_string_length)
+				limit_error(p, "too long string");
+
+			ret = grow_string(p, ret, &alloc, len, run);
+			memcpy(ret + len, p->str, run);
+			p->str += run;
+			len += run;
+			continue;
 		}
 
 		/* Worst case length is 6 UTF-8 bytes, plus termination */
-		if (len > alloc - 6 - 1) {
-			if (alloc > SIZE_MAX / 3)
-				parse_error(p, "too long string");
-
-			alloc = (alloc * 3) >> 1; /* grow by 150% */
-			ret = mem_realloc(p, ret, alloc);
-		}
-
+		ret = grow_string(p, ret, &alloc, len, 6);
 		len += encode_utf8(ret + len, buf, chars);
 	}
 	p->skip_space = 1;
+	if (len > p->max_string_length)
+		limit_error(p, "too long string");
 	consume(p);
 
 	assert(alloc > len);
@@ -273,133 +1033,263 @@ static const char *parse_raw_string(struct json_parser *p)
 	return ret;
 }
 
+static const char *parse_raw_string(struct json_parser *p)
+{
+	return parse_quoted(p, '"');
+}
+
 
 static struct json_value *parse_string(struct json_parser *p)
 {
-	struct json_value *ret = mem_alloc(p, sizeof(*ret));
-	ret->type = JSON_STRING;
+	struct json_value *ret = new_value(p, JSON_STRING);
 	ret->value.string = parse_raw_string(p);
 	return ret;
 }
 
+/* moves the properties pushed since base from the scratch stack to obj */
+static void finish_object(struct json_parser *p, struct json_value *obj,
+                          size_t base)
+{
+	size_t i, num = (p->scratch_len - base) / 2;
+
+	if (num > INT_MAX / sizeof(void *))
+		limit_error(p, "too big object");
+
+	if (num)
+		obj->value.object.properties = mem_alloc(p,
+		    sizeof(*obj->value.object.properties) * num);
+
+	for (i = 0; i < num; ++i) {
+		obj->value.object.properties[i].name = p->scratch[base + 2 * i].name;
+		obj->value.object.properties[i].value = p->scratch[base + 2 * i + 1].value;
+	}
+	obj->value.object.num_properties = num;
+	p->scratch_len = base;
+}
+
+static void finish_array(struct json_parser *p, struct json_value *arr,
+                         size_t base)
+{
+	size_t i, num = p->scratch_len - base;
+
+	if (num > INT_MAX / sizeof(void *))
+		limit_error(p, "too big array");
+
+	if (num)
+		arr->value.array.values = mem_alloc(p,
+		    sizeof(*arr->value.array.values) * num);
+
+	for (i = 0; i < num; ++i)
+		arr->value.array.values[i] = p->scratch[base + i].value;
+	arr->value.array.num_values = num;
+	p->scratch_len = base;
+}
+
 static struct json_value *parse_value(struct json_parser *p);
 
+static void push_frame(struct json_parser *p, struct json_value *value)
+{
+	if (p->depth == p->stack_size) {
+		struct frame *tmp;
+		int size = p->stack_size ? p->stack_size * 2 : 16;
+
+		if (p->stack_size > INT_MAX / 2 / (int)sizeof(*tmp))
+			limit_error(p, "too deep nesting");
+
+		tmp = realloc(p->stack, sizeof(*tmp) * size);
+		if (!tmp)
+			memory_error(p, "realloc failed: %s", strerror(errno));
+
+		p->stack = tmp;
+		p->stack_size = size;
+	}
+
+	p->stack[p->depth].value = value;
+	p->stack[p->depth].base = p->scratch_len;
+	++p->depth;
+}
+
+/*
+ * How deep the recursive engines go, at a couple of hundred bytes of stack
+ * per level. The others keep their stack on the heap, and go on.
+ */
+#define MAX_RECURSION_DEPTH 10000
+
+static void enter_container(struct json_parser *p, struct json_value *value)
+{
+	if (p->depth >= p->max_depth)
+		limit_error(p, "too deep nesting (limit %d)", p->max_depth);
+	if (p->depth >= MAX_RECURSION_DEPTH)
+		limit_error(p, "too deep nesting to parse recursively (limit %d)",
+		            MAX_RECURSION_DEPTH);
+	push_frame(p, value);
+}
+
 static struct json_value *parse_object(struct json_parser *p)
 {
-	struct json_value *ret = mem_alloc(p, sizeof(*ret));
-	ret->type = JSON_OBJECT;
+	size_t base;
+	struct json_value *ret = new_value(p, JSON_OBJECT);
 	ret->value.object.properties = NULL;
 	ret->value.object.num_properties = 0;
 
+	enter_container(p, ret);
 	expect(p, '{');
 	if (next(p) == '}') {
 		consume(p);
+		--p->depth;
 		return ret;
 	}
 
+	base = p->scratch_len;
 	while (1) {
-		void *tmp;
 		struct json_value *value;
 		const char *name = parse_raw_string(p);
+		push_slot(p)->name = name;
 		expect(p, ':');
 		value = parse_value(p);
-
-		if (ret->value.object.num_properties == INT_MAX / sizeof(void *))
-			parse_error(p, "too big object");
-
-		tmp = mem_realloc(p, ret->value.object.properties,
-		                  sizeof(*ret->value.object.properties) *
-		                  (ret->value.object.num_properties + 1));
-
-		ret->value.object.properties = tmp;
-		ret->value.object.properties[ret->value.object.num_properties].name = name;
-		ret->value.object.properties[ret->value.object.num_properties].value = value;
-		++ret->value.object.num_properties;
+		push_slot(p)->value = value;
 
 		if (next(p) == '}')
 			break;
 		expect(p, ',');
 	}
 	consume(p);
+	finish_object(p, ret, base);
+	--p->depth;
 
 	return ret;
 }
 
 static struct json_value *parse_array(struct json_parser *p)
 {
-	struct json_value *ret = mem_alloc(p, sizeof(*ret));
-	ret->type = JSON_ARRAY;
+	size_t base;
+	struct json_value *ret = new_value(p, JSON_ARRAY);
 	ret->value.array.values = NULL;
 	ret->value.array.num_values = 0;
 
+	enter_container(p, ret);
 	expect(p, '[');
 	if (next(p) == ']') {
 		consume(p);
+		--p->depth;
 		return ret;
 	}
 
+	base = p->scratch_len;
 	while (1) {
-		void *tmp;
 		struct json_value *value = parse_value(p);
-
-		if (ret->value.array.num_values == INT_MAX / sizeof(void *))
-			parse_error(p, "too big array");
-
-		tmp = mem_realloc(p, ret->value.array.values,
-		                  sizeof(*ret->value.array.values) *
-		                  (ret->value.array.num_values + 1));
-
-		ret->value.array.values = tmp;
-		ret->value.array.values[ret->value.array.num_values] = value;
-		++ret->value.array.num_values;
+		push_slot(p)->value = value;
 
 		if (next(p) == ']')
 			break;
 		expect(p, ',');
 	}
 	consume(p);
+	finish_array(p, ret, base);
+	--p->depth;
 
 	return ret;
 }
 
+/* counts the digits from the first to the last non-zero one of a mantissa */
+static int significant_digits(const char *str, const char *end)
+{
+	int count = 0, ret = 0;
+
+	for (; str < end && tolower(*str) != 'e'; ++str) {
+		if (!isdigit(*str) || (!count && *str == '0'))
+			continue;
+		++count;
+		if (*str != '0')
+			ret = count;
+	}
+	return ret;
+}
+
+/*
+ * JSON_EXACT_NUMBERS: numbers that a double can't hold exactly are kept as
+ * decimal text. Those with too many digits aren't converted at all, the
+ * others only as long as strtod() neither overflows nor loses precision.
+ */
+static void parse_exact_number(struct json_parser *p, struct json_value *ret,
+                               const char *start, const char *end)
+{
+	size_t len = end - start;
+	int digits = significant_digits(start, end);
+
+	if (digits <= DBL_DIG) {
+		double val = strtod(start, NULL);
+		if (!isinf(val) && (!digits || fabs(val) >= DBL_MIN)) {
+			ret->value.number = val;
+			return;
+		}
+	}
+
+	if (len > INT_MAX)
+		limit_error(p, "too long number");
+
+	/* the chunked input window gets reused, so that needs a copy */
+	if (p->end) {
+		char *tmp = mem_alloc(p, len + 1);
+		memcpy(tmp, start, len);
+		tmp[len] = '\0';
+		start = tmp;
+	}
+
+	ret->type = JSON_DECIMAL;
+	ret->value.decimal.str = start;
+	ret->value.decimal.len = len;
+}
+
 static struct json_value *parse_number(struct json_parser *p)
 {
-	const char *start = p->str;
+	const char *start = p->str, *str = start, *digits, *int_end;
 	char *end;
-	struct json_value *ret = mem_alloc(p, sizeof(*ret));
-	ret->type = JSON_NUMBER;
+	struct json_value *ret = new_value(p, JSON_NUMBER);
 
-	if (next(p) == '-')
-		consume(p);
+	if (*str == '-')
+		++str;
 
-	if (!isdigit(next(p)))
-		unexpected_token(p);
+	digits = str;
+	if (!isdigit(*str))
+		goto error;
 
-	if (consume(p) != '0')
-		while (isdigit(next(p)))
-			consume(p);
+	if (*str++ != '0')
+		str += p->kernels->scan_digits(str);
+	int_end = str;
 
-	if (next(p) == '.') {
-		consume(p);
+	if (*str == '.') {
+		++str;
+		if (!isdigit(*str))
+			goto error;
+		str += p->kernels->scan_digits(str);
+	}
 
-		if (!isdigit(next(p)))
-			unexpected_token(p);
+	if (tolower(*str) == 'e') {
+		++str;
+		if (*str == '+' || *str == '-')
+			++str;
 
-		while (isdigit(next(p)))
-			consume(p);
+		if (!isdigit(*str))
+			goto error;
+		str += p->kernels->scan_digits(str);
 	}
 
-	if (tolower(next(p)) == 'e') {
-		consume(p);
-		if (next(p) == '+' ||
-		    next(p) == '-')
-			consume(p);
+	p->str = str;
+	skip_space(p);
 
-		if (!isdigit(next(p)))
-			unexpected_token(p);
+	if (str == int_end && str - digits <= DBL_DIG) {
+		/* integers this short are exact in a double, skip strtod() */
+		uint64_t val = 0;
+		for (; digits < str; ++digits)
+			val = val * 10 + (*digits - '0');
+		ret->value.number = *start == '-' ? -(double)val : (double)val;
+		return ret;
+	}
 
-		while (isdigit(next(p)))
-			consume(p);
+	if (p->flags & JSON_EXACT_NUMBERS) {
+		parse_exact_number(p, ret, start, str);
+		return ret;
 	}
 
 	ret->value.number = strtod(start, &end);
@@ -407,6 +1297,12 @@ static struct json_value *parse_number(struct json_parser *p)
 		parse_error(p, "strtod failed: %s", strerror(errno));
 
 	return ret;
+
+error:
+	/* errors are reported at the next token, like everywhere else */
+	p->str = str;
+	skip_space(p);
+	return unexpected_token(p), NULL;
 }
 
 static struct json_value *parse_keyword(struct json_parser *p, const char *str, int len)
@@ -416,7 +1312,7 @@ static struct json_value *parse_keyword(struct json_parser *p, const char *str,
 	consume(p);
 	for (i = 1; i < len; ++i)
 		expect(p, str[i]);
-	return mem_alloc(p, sizeof(struct json_value));
+	return new_value(p, JSON_NULL);
 }
 
 static struct json_value *parse_value(struct json_parser *p)
@@ -452,53 +1348,1097 @@ static struct json_value *parse_value(struct json_parser *p)
 	return unexpected_token(p), NULL;
 }
 
+/*
+ * JSON_RELAXED: JSON5-style comments, trailing commas, single-quoted strings,
+ * unquoted property names, hexadecimal numbers, Infinity and NaN. Containers
+ * and numbers get parsers of their own, so the strict ones stay as they are.
+ */
+static struct json_value *parse_relaxed_value(struct json_parser *p);
+
+static int is_ident(char ch, int first)
+{
+	return isalpha(ch) || ch == '_' || ch == '$' || (!first && isdigit(ch));
+}
+
+static const char *parse_relaxed_name(struct json_parser *p)
+{
+	const char *start = p->str;
+	size_t len;
+	char *ret;
+
+	switch (next(p)) {
+	case '"':
+		return parse_raw_string(p);
+
+	case '\'':
+		return parse_quoted(p, '\'');
+	}
+
+	if (!is_ident(next(p), 1))
+		unexpected_token(p);
+
+	while (is_ident(*p->str, 0))
+		++p->str;
+
+	len = p->str - start;
+	if (len > p->max_string_length)
+		limit_error(p, "too long string");
+
+	ret = mem_alloc(p, len + 1);
+	memcpy(ret, start, len);
+	ret[len] = '\0';
+	skip_space(p);
+	return ret;
+}
+
+static struct json_value *parse_relaxed_object(struct json_parser *p)
+{
+	size_t base = p->scratch_len;
+	struct json_value *ret = new_value(p, JSON_OBJECT);
+	ret->value.object.properties = NULL;
+	ret->value.object.num_properties = 0;
+
+	enter_container(p, ret);
+	expect(p, '{');
+	while (next(p) != '}') {
+		struct json_value *value;
+		const char *name = parse_relaxed_name(p);
+		push_slot(p)->name = name;
+		expect(p, ':');
+		value = parse_relaxed_value(p);
+		push_slot(p)->value = value;
+
+		if (next(p) != '}')
+			expect(p, ',');
+	}
+	consume(p);
+	finish_object(p, ret, base);
+	--p->depth;
+
+	return ret;
+}
+
+static struct json_value *parse_relaxed_array(struct json_parser *p)
+{
+	size_t base = p->scratch_len;
+	struct json_value *ret = new_value(p, JSON_ARRAY);
+	ret->value.array.values = NULL;
+	ret->value.array.num_values = 0;
+
+	enter_container(p, ret);
+	expect(p, '[');
+	while (next(p) != ']') {
+		struct json_value *value = parse_relaxed_value(p);
+		push_slot(p)->value = value;
+
+		if (next(p) != ']')
+			expect(p, ',');
+	}
+	consume(p);
+	finish_array(p, ret, base);
+	--p->depth;
+
+	return ret;
+}
+
+static struct json_value *parse_relaxed_number(struct json_parser *p)
+{
+	const char *str = p->str, *digits, *dot;
+	struct json_value *ret = new_value(p, JSON_NUMBER);
+	double sign = 1, val = 0;
+
+	if (*str == '+' || *str == '-')
+		sign = *str++ == '-' ? -1 : 1;
+
+	if (!strncmp(str, "Infinity", 8)) {
+		val = INFINITY;
+		str += 8;
+	} else if (!strncmp(str, "NaN", 3)) {
+		val = NAN;
+		str += 3;
+	} else if (str[0] == '0' && tolower(str[1]) == 'x') {
+		for (str += 2, digits = str; isxdigit(*str); ++str)
+			val = val * 16 + (isdigit(*str) ? *str - '0' :
+			                  10 + tolower(*str) - 'a');
+		if (str == digits)
+			goto error;
+	} else {
+		/* leading and trailing decimal points are fine */
+		digits = str;
+		while (isdigit(*str))
+			++str;
+		if (*str == '.')
+			++str;
+		while (isdigit(*str))
+			++str;
+		if (str == digits || (str == digits + 1 && *digits == '.'))
+			goto error;
+
+		if (tolower(*str) == 'e') {
+			++str;
+			if (*str == '+' || *str == '-')
+				++str;
+			if (!isdigit(*str))
+				goto error;
+			while (isdigit(*str))
+				++str;
+		}
+
+		/* JSON_EXACT_NUMBERS keeps to numbers in standard syntax */
+		dot = memchr(digits, '.', str - digits);
+		if ((p->flags & JSON_EXACT_NUMBERS) && *p->str != '+' &&
+		    isdigit(digits[0]) && (digits[0] != '0' || !isdigit(digits[1])) &&
+		    (!dot || isdigit(dot[1]))) {
+			parse_exact_number(p, ret, p->str, str);
+			p->str = str;
+			skip_space(p);
+			return ret;
+		}
+		val = strtod(digits, NULL);
+	}
+
+	ret->value.number = sign * val;
+	p->str = str;
+	skip_space(p);
+	return ret;
+
+error:
+	p->str = str;
+	return unexpected_token(p), NULL;
+}
+
+static struct json_value *parse_relaxed_value(struct json_parser *p)
+{
+	struct json_value *ret;
+	switch (next(p)) {
+	case '{': return parse_relaxed_object(p);
+	case '[': return parse_relaxed_array(p);
+
+	case '\'':
+		ret = new_value(p, JSON_STRING);
+		ret->value.string = parse_quoted(p, '\'');
+		return ret;
+
+	case '+': case '-': case '.': case 'I': case 'N':
+	case '0': case '1': case '2': case '3': case '4':
+	case '5': case '6': case '7': case '8': case '9':
+		return parse_relaxed_number(p);
+	}
+	return parse_value(p);
+}
+
+/* the top-level entry to the recursive parser */
+static struct json_value *parse_root(struct json_parser *p)
+{
+	return p->relaxed ? parse_relaxed_value(p) : parse_value(p);
+}
+
+static void add_value(struct json_parser *p, struct json_value *value)
+{
+	if (!p->depth) {
+		p->root = value;
+		p->state = STATE_END;
+		return;
+	}
+
+	push_slot(p)->value = value;
+	p->state = STATE_NEXT;
+}
+
+static void open_container(struct json_parser *p, int type, char close)
+{
+	struct json_value *ret = new_value(p, type);
+
+	if (p->depth >= p->max_depth)
+		limit_error(p, "too deep nesting (limit %d)", p->max_depth);
+
+	if (type == JSON_OBJECT) {
+		ret->value.object.properties = NULL;
+		ret->value.object.num_properties = 0;
+	} else {
+		ret->value.array.values = NULL;
+		ret->value.array.num_values = 0;
+	}
+
+	consume(p);
+	check_input(p);
+	if (next(p) == close) {
+		consume(p);
+		add_value(p, ret);
+		return;
+	}
+
+	push_frame(p, ret);
+	p->state = type == JSON_OBJECT ? STATE_NAME : STATE_VALUE;
+}
+
+/*
+ * Iterative counterpart to parse_value(), keeping the nesting in p->stack
+ * instead of on the C stack, so parsing can be suspended between tokens.
+ * Returns non-zero if there's more input left to parse.
+ */
+static int parse_step(struct json_parser *p, size_t max_bytes)
+{
+	const char *start = p->str;
+	struct json_value *value;
+	struct frame *top;
+
+	do {
+		/* where to resume if we run out of input mid-token */
+		p->mark = p->str;
+		p->mark_line = p->line;
+		p->mark_scratch = p->scratch_len;
+		p->mark_nodes = p->nodes;
+		arena_mark(p, &p->mark_arena);
+
+		switch (p->state) {
+		case STATE_VALUE:
+			switch (next(p)) {
+			case '{':
+				open_container(p, JSON_OBJECT, '}');
+				break;
+
+			case '[':
+				open_container(p, JSON_ARRAY, ']');
+				break;
+
+			default:
+				value = parse_value(p);
+				check_input(p); /* might continue in the next chunk */
+				add_value(p, value);
+			}
+			break;
+
+		case STATE_NAME:
+			push_slot(p)->name = parse_raw_string(p);
+			expect(p, ':');
+			p->state = STATE_VALUE;
+			break;
+
+		case STATE_NEXT:
+			top = &p->stack[p->depth - 1];
+			if (next(p) == (top->value->type == JSON_OBJECT ? '}' : ']')) {
+				consume(p);
+				if (top->value->type == JSON_OBJECT)
+					finish_object(p, top->value, top->base);
+				else
+					finish_array(p, top->value, top->base);
+				--p->depth;
+				add_value(p, top->value);
+				break;
+			}
+
+			expect(p, ',');
+			p->state = top->value->type == JSON_OBJECT ? STATE_NAME :
+			                                             STATE_VALUE;
+			break;
+
+		case STATE_END:
+			check_input(p);
+			expect(p, '\0');
+			p->state = STATE_IDLE;
+			return 0;
+
+		case STATE_IDLE:
+			return 0;
+		}
+	} while ((size_t)(p->str - start) < max_bytes);
+
+	return 1;
+}
+
 struct json_parser *json_create_parser(void)
 {
-	struct json_parser *p = malloc(sizeof(*p));
+	struct json_parser *p = struct_malloc(sizeof(*p));
 	if (!p)
 		return NULL;
 
-	p->alloc_head = NULL;
+	p->kernels = select_kernels();
+	p->single_line = 0;
+	p->relaxed = 0;
+	p->flags = 0;
+	p->blocks = NULL;
+	p->block_size = MIN_BLOCK_SIZE;
+	p->arena_bytes = 0;
+	p->last = p->root = NULL;
+	p->err = NULL;
+	p->error_code = JSON_ERROR_NONE;
+	json_set_limits(p, NULL);
+	p->scratch = NULL;
+	p->scratch_size = 0;
+	p->state = STATE_IDLE;
+	p->stack = NULL;
+	p->depth = p->stack_size = 0;
+	p->input = NULL;
+	p->input_size = 0;
+	p->eof = 0;
 	return p;
 }
 
 static void free_allocs(struct json_parser *p)
 {
-	struct alloc *curr = p->alloc_head;
-	while (curr != NULL) {
-		void *mem = curr;
-		curr = curr->next;
-		free(mem);
-	}
-	p->alloc_head = NULL;
+	free_blocks(p->blocks);
+	p->blocks = NULL;
+	p->arena_bytes = 0;
+	p->last = NULL;
 }
 
 void json_destroy_parser(struct json_parser *p)
 {
 	free_allocs(p);
+	free(p->scratch);
+	free(p->stack);
+	free(p->input);
 	free(p);
 }
 
-struct json_value *json_parse(struct json_parser *p, const char *str,
-                              void (*err)(int, const char *))
+void json_set_flags(struct json_parser *p, unsigned flags)
 {
-	struct json_value *ret;
+	p->flags = flags;
+	p->block_size = initial_block_size(p);
+}
 
-	if (setjmp(p->jmp)) {
-		if (err)
-			err(p->line, p->error);
+void json_set_limits(struct json_parser *p, const struct json_limits *limits)
+{
+	static const struct json_limits none = { 0, 0, 0, 0 };
+	if (!limits)
+		limits = &none;
+
+	p->max_bytes = limits->max_bytes ? limits->max_bytes : SIZE_MAX;
+	p->max_nodes = limits->max_nodes ? limits->max_nodes : SIZE_MAX;
+	p->max_string_length = limits->max_string_length ?
+	                       limits->max_string_length : SIZE_MAX;
+	p->max_depth = limits->max_depth ? limits->max_depth : INT_MAX;
+}
+
+size_t json_memory_usage(const struct json_parser *p)
+{
+	return p->arena_bytes;
+}
+
+void json_alloc_stats(size_t *calls, size_t *bytes)
+{
+#ifdef JSON_COUNT_ALLOCS
+	*calls = __atomic_load_n(&alloc_calls, __ATOMIC_RELAXED);
+	*bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+#else
+	*calls = *bytes = 0;
+#endif
+}
 
+const char *json_kernel_name(const struct json_parser *p)
+{
+	return p->kernels->name;
+}
+
+enum json_error json_last_error(const struct json_parser *p)
+{
+	return p->error_code;
+}
+
+void json_reset_parser(struct json_parser *p)
+{
+	struct block *keep = p->blocks;
+
+	/* hang on to the most recent block, unless it's an oversized one */
+	if (keep && keep->size <= MAX_BLOCK_SIZE) {
+		p->blocks = keep->next;
+		free_allocs(p);
+		keep->next = NULL;
+		keep->used = BLOCK_HEADER;
+		p->blocks = keep;
+		p->arena_bytes = keep->size;
+	} else
 		free_allocs(p);
+
+	p->last = p->root = NULL;
+	p->err = NULL;
+	p->eof = 0;
+	p->state = STATE_IDLE;
+}
+
+struct json_document *json_detach(struct json_parser *p)
+{
+	struct json_document *doc = struct_malloc(sizeof(*doc));
+	if (!doc)
+		return NULL;
+
+	doc->blocks = p->blocks;
+	doc->root = p->last;
+	doc->refs = 1;
+	p->blocks = NULL;
+	p->arena_bytes = 0;
+	p->last = NULL;
+
+	/* start over with small blocks, in case the next document is tiny */
+	p->block_size = initial_block_size(p);
+	return doc;
+}
+
+double json_number(const struct json_value *v)
+{
+	/* decimal text is always followed by something that's not a digit */
+	return v->type == JSON_DECIMAL ? strtod(v->value.decimal.str, NULL) :
+	                                 v->value.number;
+}
+
+const struct json_value *json_document_root(const struct json_document *doc)
+{
+	return doc->root;
+}
+
+struct json_document *json_ref_document(struct json_document *doc)
+{
+	__atomic_fetch_add(&doc->refs, 1, __ATOMIC_RELAXED);
+	return doc;
+}
+
+void json_free_document(struct json_document *doc)
+{
+	/* make other threads' reads happen before the memory is freed */
+	if (__atomic_sub_fetch(&doc->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	free_blocks(doc->blocks);
+	free(doc);
+}
+
+/* siblings are prefetched this far ahead of the one being visited */
+#define PREFETCH_DISTANCE 4
+
+/*
+ * Tree walks keep their stack on the heap, like the time-sliced parser, as
+ * trees from it can be nested deeper than the C stack allows.
+ */
+struct walk_frame {
+	const struct json_value *src;
+	struct json_value *dst; /* the copy, when compacting */
+	int next, num;
+};
+
+struct walk {
+	struct walk_frame *frames;
+	size_t depth, size;
+};
+
+static int num_children(const struct json_value *v)
+{
+	switch (v->type) {
+	case JSON_OBJECT:
+		return v->value.object.num_properties;
+
+	case JSON_ARRAY:
+		return v->value.array.num_values;
+
+	default:
+		return 0;
+	}
+}
+
+/* pushes v if it has children to walk, returns -1 when out of memory */
+static int walk_push(struct walk *w, const struct json_value *src,
+                     struct json_value *dst)
+{
+	int num = num_children(src);
+
+	if (!num)
+		return 0;
+
+	if (w->depth == w->size) {
+		size_t size = w->size ? w->size * 2 : 32;
+		struct walk_frame *tmp;
+
+		if (w->size > SIZE_MAX / 2 / sizeof(*tmp))
+			return -1;
+		tmp = realloc(w->frames, sizeof(*tmp) * size);
+		if (!tmp)
+			return -1;
+		w->frames = tmp;
+		w->size = size;
+	}
+
+	w->frames[w->depth].src = src;
+	w->frames[w->depth].dst = dst;
+	w->frames[w->depth].next = 0;
+	w->frames[w->depth].num = num;
+	++w->depth;
+	return 0;
+}
+
+int json_visit(const struct json_value *root,
+               int (*cb)(const struct json_value *, const char *, int, void *),
+               void *data)
+{
+	struct walk w = { NULL, 0, 0 };
+	int ret;
+
+	if ((ret = cb(root, NULL, 0, data)))
+		return ret;
+	if (walk_push(&w, root, NULL))
+		return -1;
+
+	while (w.depth) {
+		struct walk_frame *top = &w.frames[w.depth - 1];
+		const struct json_value *v = top->src, *child;
+		const char *name = NULL;
+		int i = top->next++;
+
+		if (i == top->num) {
+			--w.depth;
+			continue;
+		}
+
+		if (v->type == JSON_OBJECT) {
+			if (i + PREFETCH_DISTANCE < top->num)
+				__builtin_prefetch(v->value.object.properties
+				                   [i + PREFETCH_DISTANCE].value);
+			child = v->value.object.properties[i].value;
+			name = v->value.object.properties[i].name;
+		} else {
+			if (i + PREFETCH_DISTANCE < top->num)
+				__builtin_prefetch(v->value.array.values
+				                   [i + PREFETCH_DISTANCE]);
+			child = v->value.array.values[i];
+		}
+
+		if ((ret = cb(child, name, (int)w.depth, data)))
+			break;
+		if (walk_push(&w, child, NULL)) {
+			ret = -1;
+			break;
+		}
+	}
+
+	free(w.frames);
+	return ret;
+}
+
+static int compact_size(const struct json_value *v, const char *name,
+                        int depth, void *data)
+{
+	size_t *size = data;
+	(void)depth;
+
+	*size += ALIGN(sizeof(*v));
+	if (name)
+		*size += ALIGN(strlen(name) + 1);
+
+	switch (v->type) {
+	case JSON_STRING:
+		*size += ALIGN(strlen(v->value.string) + 1);
+		break;
+
+	case JSON_DECIMAL:
+		*size += ALIGN((size_t)v->value.decimal.len + 1);
+		break;
+
+	case JSON_OBJECT:
+		*size += ALIGN(sizeof(*v->value.object.properties) *
+		               v->value.object.num_properties);
+		break;
+
+	case JSON_ARRAY:
+		*size += ALIGN(sizeof(*v->value.array.values) *
+		               v->value.array.num_values);
+		break;
+
+	default:
+		break;
+	}
+	return 0;
+}
+
+static char *compact_string(char **dst, const char *str, size_t len)
+{
+	char *ret = *dst;
+	memcpy(ret, str, len);
+	ret[len] = '\0';
+	*dst += ALIGN(len + 1);
+	return ret;
+}
+
+/* copies v to *dst, leaving room for a container's array right after it */
+static struct json_value *compact_node(char **dst, const struct json_value *v)
+{
+	struct json_value *ret = (struct json_value *)*dst;
+	int num = num_children(v);
+
+	*dst += ALIGN(sizeof(*ret));
+	*ret = *v;
+
+	switch (v->type) {
+	case JSON_STRING:
+		ret->value.string = compact_string(dst, v->value.string,
+		                                   strlen(v->value.string));
+		break;
+
+	case JSON_DECIMAL:
+		ret->value.decimal.str = compact_string(dst, v->value.decimal.str,
+		                                        v->value.decimal.len);
+		break;
+
+	case JSON_OBJECT:
+		if (num) {
+			ret->value.object.properties = (void *)*dst;
+			*dst += ALIGN(sizeof(*ret->value.object.properties) * num);
+		}
+		break;
+
+	case JSON_ARRAY:
+		if (num) {
+			ret->value.array.values = (void *)*dst;
+			*dst += ALIGN(sizeof(*ret->value.array.values) * num);
+		}
+		break;
+
+	default:
+		break;
+	}
+	return ret;
+}
+
+/* copies the tree under root to *dst in depth-first order */
+static struct json_value *compact_tree(char **dst,
+                                       const struct json_value *root)
+{
+	struct walk w = { NULL, 0, 0 };
+	struct json_value *ret = compact_node(dst, root);
+
+	if (walk_push(&w, root, ret))
 		return NULL;
+
+	while (w.depth) {
+		struct walk_frame *top = &w.frames[w.depth - 1];
+		const struct json_value *child;
+		struct json_value *copy;
+		int i = top->next++;
+
+		if (i == top->num) {
+			--w.depth;
+			continue;
+		}
+
+		if (top->src->type == JSON_OBJECT) {
+			const char *name = top->src->value.object.properties[i].name;
+			top->dst->value.object.properties[i].name =
+			    compact_string(dst, name, strlen(name));
+			child = top->src->value.object.properties[i].value;
+			copy = compact_node(dst, child);
+			top->dst->value.object.properties[i].value = copy;
+		} else {
+			child = top->src->value.array.values[i];
+			copy = compact_node(dst, child);
+			top->dst->value.array.values[i] = copy;
+		}
+
+		if (walk_push(&w, child, copy)) {
+			free(w.frames);
+			return NULL;
+		}
 	}
 
+	free(w.frames);
+	return ret;
+}
+
+struct json_document *json_compact(const struct json_value *root)
+{
+	struct json_document *doc = struct_malloc(sizeof(*doc));
+	size_t size = BLOCK_HEADER;
+	char *dst;
+
+	if (!doc)
+		return NULL;
+
+	/* measure first, so the whole tree fits a single block */
+	if (json_visit(root, compact_size, &size) ||
+	    !(doc->blocks = malloc(size))) {
+		free(doc);
+		return NULL;
+	}
+	doc->blocks->next = NULL;
+	doc->blocks->size = doc->blocks->used = size;
+	doc->blocks->mmapped = 0;
+
+	dst = (char *)doc->blocks + BLOCK_HEADER;
+	doc->root = compact_tree(&dst, root);
+	if (!doc->root) {
+		free(doc->blocks);
+		free(doc);
+		return NULL;
+	}
+	assert(dst == (char *)doc->blocks + size);
+	doc->refs = 1;
+	return doc;
+}
+
+static void begin(struct json_parser *p, const char *str)
+{
 	p->skip_space = 1;
 	p->str = str;
+	p->end = NULL;
 	p->line = 1;
-	skip_space(p);
+	p->error_code = JSON_ERROR_NONE;
+	p->scratch_len = 0;
+	p->nodes = 0;
+	p->depth = 0;
+	p->root = NULL;
+	arena_mark(p, &p->start);
+	if (str)
+		skip_space(p);
+}
+
+/* closes the containers that were still open when parsing failed */
+static struct json_value *close_partial(struct json_parser *p)
+{
+	while (p->depth) {
+		struct frame *top = &p->stack[--p->depth];
+
+		if (top->value->type == JSON_OBJECT) {
+			/* drop a trailing property name without a value */
+			p->scratch_len -= (p->scratch_len - top->base) & 1;
+			finish_object(p, top->value, top->base);
+		} else
+			finish_array(p, top->value, top->base);
+
+		if (!p->depth)
+			return top->value;
+		push_slot(p)->value = top->value;
+	}
+	return p->root;
+}
+
+/*
+ * Rolls back the memory of the failed parse, leaving earlier values alone,
+ * or with JSON_PARTIAL_RESULTS, returns what was parsed before the error.
+ */
+static struct json_value *fail_parse(struct json_parser *p,
+                                     void (*err)(int, const char *))
+{
+	/* still NULL if close_partial() longjmps back here */
+	struct json_value *volatile ret = NULL;
+
+	if (err)
+		err(p->line, p->error);
+
+	p->state = STATE_IDLE;
+	if (p->flags & JSON_PARTIAL_RESULTS) {
+		/* callers might want to keep using their jump target */
+		jmp_buf saved;
+		memcpy(saved, p->jmp, sizeof(saved));
+		if (!setjmp(p->jmp))
+			ret = close_partial(p);
+		memcpy(p->jmp, saved, sizeof(saved));
+	}
+
+	if (ret)
+		p->last = ret;
+	else
+		arena_rollback(p, &p->start);
+	return ret;
+}
+
+struct json_value *json_parse(struct json_parser *p, const char *str,
+                              void (*err)(int, const char *))
+{
+	struct json_value *ret;
+
+	if (setjmp(p->jmp))
+		return fail_parse(p, err);
+
+	p->state = STATE_IDLE;
+	p->single_line = 0;
+	p->relaxed = !!(p->flags & JSON_RELAXED);
+	begin(p, str);
 
-	ret = parse_value(p);
+	ret = p->root = parse_root(p);
 	expect(p, '\0');
 
+	p->last = ret;
 	return ret;
 }
+
+struct json_value *json_parse_next(struct json_parser *p, const char *str,
+                                   size_t *offset,
+                                   void (*err)(int, const char *))
+{
+	struct json_value *ret;
+
+	if (setjmp(p->jmp)) {
+		/*
+		 * There's no telling where the next value starts, so that was
+		 * the last one. Partial results would be returned over and over
+		 * otherwise.
+		 */
+		*offset += strlen(str + *offset);
+		return fail_parse(p, err);
+	}
+
+	p->state = STATE_IDLE;
+	p->single_line = 0;
+	p->relaxed = !!(p->flags & JSON_RELAXED);
+	begin(p, NULL);
+
+	/* keep counting lines from where the previous value ended */
+	if (*offset)
+		p->line = p->next_line;
+	p->str = str + *offset;
+	skip_space(p);
+	if (next(p) == '\0') {
+		*offset = p->str - str;
+		return NULL;
+	}
+
+	ret = p->root = parse_root(p);
+
+	*offset = p->str - str;
+	p->next_line = p->line;
+	p->last = ret;
+	return ret;
+}
+
+int json_parse_batch(struct json_parser *p, const char *const *strs,
+                     size_t count, struct json_value **roots,
+                     void (*err)(int, const char *))
+{
+	volatile size_t i = 0;
+	volatile int errors = 0;
+
+	p->state = STATE_IDLE;
+	p->single_line = 0;
+	p->relaxed = !!(p->flags & JSON_RELAXED);
+
+	/* one jump target for the whole batch, re-armed by fail_parse() */
+	if (setjmp(p->jmp)) {
+		roots[i] = fail_parse(p, err);
+		++errors;
+		++i;
+	}
+
+	for (; i < count; ++i) {
+		begin(p, NULL);
+		p->str = strs[i];
+		skip_space(p);
+
+		roots[i] = p->root = parse_root(p);
+		expect(p, '\0');
+		p->last = roots[i];
+	}
+	return errors;
+}
+
+/* skips to the start of the next non-blank line, if any */
+static int next_record(struct json_parser *p)
+{
+	while (1) {
+		skip_space(p);
+		switch (next(p)) {
+		case '\r':
+			if (p->str[1] == '\n')
+				++p->str;
+			/* fall through */
+		case '\n':
+			++p->str;
+			++p->line;
+			break;
+
+		case '\0':
+			return 0;
+
+		default:
+			return 1;
+		}
+	}
+}
+
+static void deliver(struct json_parser *p, struct json_value *value,
+                    void (*cb)(struct json_value *, void *), void *data)
+{
+	p->last = value;
+	cb(value, data);
+
+	/* unless the callback detached it, the value's memory is reused */
+	if (p->last)
+		arena_rollback(p, &p->start);
+	p->last = NULL;
+}
+
+int json_parse_lines(struct json_parser *p, const char *str,
+                     void (*cb)(struct json_value *, void *),
+                     void (*err)(int, const char *), void *data)
+{
+	volatile int errors = 0;
+
+	p->state = STATE_IDLE;
+	p->single_line = 1;
+	p->relaxed = !!(p->flags & JSON_RELAXED);
+	begin(p, NULL);
+	p->str = str;
+
+	if (setjmp(p->jmp)) {
+		struct json_value *value = fail_parse(p, err);
+
+		++errors;
+		if (value)
+			deliver(p, value, cb, data);
+		else
+			p->last = NULL;
+
+		/* resynchronize at the next line, ended like next_record() does */
+		p->skip_space = 1;
+		p->str += strcspn(p->str, "\r\n");
+	}
+
+	while (next_record(p)) {
+		struct json_value *value;
+
+		p->scratch_len = 0;
+		p->nodes = 0;
+		p->depth = 0;
+		p->root = NULL;
+		arena_mark(p, &p->start);
+
+		value = p->root = parse_root(p);
+		switch (next(p)) {
+		case '\n':
+		case '\r':
+		case '\0':
+			break;
+
+		default:
+			expect(p, '\n');
+		}
+
+		deliver(p, value, cb, data);
+	}
+
+	p->single_line = 0;
+	return errors;
+}
+
+void json_parse_begin(struct json_parser *p, const char *str,
+                      void (*err)(int, const char *))
+{
+	p->err = err;
+	p->state = STATE_VALUE;
+	p->single_line = 0;
+	p->relaxed = 0;
+
+	begin(p, str);
+	if (!str) {
+		p->str = p->end = p->input;
+		p->eof = 0;
+		p->retry_len = 0;
+	}
+}
+
+int json_parse_step(struct json_parser *p, size_t max_bytes,
+                    struct json_value **value)
+{
+	*value = NULL;
+	/* nothing begun, or already done: keep the last value as it is */
+	if (p->state == STATE_IDLE)
+		return 0;
+
+	switch (setjmp(p->jmp)) {
+	case 0:
+		break;
+
+	case 1:
+		/* out of input, roll back to the start of the token */
+		arena_rollback(p, &p->mark_arena);
+		p->scratch_len = p->mark_scratch;
+		p->nodes = p->mark_nodes;
+		p->str = p->mark;
+		p->line = p->mark_line;
+		p->skip_space = 1;
+		p->retry_len = 2 * (p->end - p->str);
+		return 1;
+
+	default:
+		*value = fail_parse(p, p->err);
+		return 0;
+	}
+
+	if (parse_step(p, max_bytes))
+		return 1;
+
+	*value = p->last = p->root;
+	p->root = NULL;
+	return 0;
+}
+
+/*
+ * Appends a chunk to the unparsed tail of the input window. Returns zero if
+ * there's too little new input to be worth retrying a suspended token yet.
+ */
+static int append_input(struct json_parser *p, const char *buf, size_t len)
+{
+	size_t keep = p->end - p->str;
+
+	/* a CR LF pair split between chunks is a single line break */
+	if (!keep && len && p->str > p->input && p->str[-1] == '\r' &&
+	    *buf == '\n') {
+		++buf;
+		--len;
+	}
+
+	if (keep + len >= p->input_size) {
+		size_t size = p->input_size ? p->input_size : 4096;
+		char *tmp;
+
+		while (size <= keep + len) {
+			if (size > SIZE_MAX / 2)
+				return -1;
+			size *= 2;
+		}
+
+		tmp = malloc(size);
+		if (!tmp)
+			return -1;
+
+		if (keep)
+			memcpy(tmp, p->str, keep);
+		free(p->input);
+		p->input = tmp;
+		p->input_size = size;
+	} else
+		memmove(p->input, p->str, keep);
+
+	if (len)
+		memcpy(p->input + keep, buf, len);
+	p->input[keep + len] = '\0';
+	p->str = p->input;
+	p->end = p->input + keep + len;
+
+	return keep + len >= p->retry_len;
+}
+
+int json_parse_feed(struct json_parser *p, const char *buf, size_t len,
+                    struct json_value **value)
+{
+	int ret;
+
+	*value = NULL;
+	if (p->state == STATE_IDLE)
+		return 0;
+
+	if (!len)
+		p->eof = 1;
+
+	ret = append_input(p, buf, len);
+	if (ret < 0) {
+		snprintf(p->error, sizeof(p->error), "too much buffered input");
+		p->error_code = JSON_ERROR_MEMORY;
+		*value = fail_parse(p, p->err);
+		return 0;
+	}
+
+	if (!ret && !p->eof)
+		return 1;
+
+	/* we always suspend between tokens, so whitespace is safe to skip */
+	skip_space(p);
+
+	return json_parse_step(p, SIZE_MAX, value);
+}
@@ -1,6 +1,17 @@
 #ifndef JSON_H
 #define JSON_H
 
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * The library is built with symbols hidden by default, so what's declared
+ * here is all it exports.
+ */
+#ifdef __GNUC__
+#pragma GCC visibility push(default)
+#endif
+
 struct json_value {
 	enum {
 		JSON_STRING,
@@ -8,7 +19,8 @@ struct json_value {
 		JSON_OBJECT,
 		JSON_ARRAY,
 		JSON_BOOLEAN,
-		JSON_NULL
+		JSON_NULL,
+		JSON_DECIMAL /* only with JSON_EXACT_NUMBERS */
 	} type;
 
 	union {
@@ -26,14 +38,243 @@ struct json_value {
 			int num_values;
 		} array;
 		int boolean;
+		struct {
+			const char *str; /* not NUL-terminated */
+			int len;
+		} decimal;
 	} value;
 };
 
+/* the value of a JSON_NUMBER, or the closest double to a JSON_DECIMAL */
+double json_number(const struct json_value *v);
+
+/*
+ * Accessors, inline so walking a tree takes no calls into the library. They
+ * take values of any type, and give 0 or NULL for the wrong one, and for
+ * indices out of range.
+ */
+static inline int json_array_size(const struct json_value *v)
+{
+	return v->type == JSON_ARRAY ? v->value.array.num_values : 0;
+}
+
+static inline const struct json_value *
+json_array_get(const struct json_value *v, int i)
+{
+	return i >= 0 && i < json_array_size(v) ? v->value.array.values[i] :
+	                                          NULL;
+}
+
+static inline int json_object_size(const struct json_value *v)
+{
+	return v->type == JSON_OBJECT ? v->value.object.num_properties : 0;
+}
+
+/* the property's value, the last one if the name is repeated */
+static inline const struct json_value *
+json_object_get(const struct json_value *v, const char *name)
+{
+	int i = json_object_size(v);
+
+	while (i--)
+		if (!strcmp(v->value.object.properties[i].name, name))
+			return v->value.object.properties[i].value;
+	return NULL;
+}
+
+static inline const char *json_string(const struct json_value *v)
+{
+	return v->type == JSON_STRING ? v->value.string : NULL;
+}
+
+static inline int json_is_number(const struct json_value *v)
+{
+	return v->type == JSON_NUMBER || v->type == JSON_DECIMAL;
+}
+
 struct json_parser;
 
 struct json_parser *json_create_parser(void);
 void json_destroy_parser(struct json_parser *p);
+/* free all values returned so far, so the parser can be reused */
+void json_reset_parser(struct json_parser *p);
+
+enum {
+	/* back the value arena with huge pages, where supported */
+	JSON_HUGE_PAGES = 1 << 0,
+
+	/*
+	 * On errors, return the values parsed before the error, with any
+	 * open containers closed, instead of NULL. err is still called, and
+	 * json_last_error() tells partial results from complete ones.
+	 */
+	JSON_PARTIAL_RESULTS = 1 << 1,
+
+	/*
+	 * Accept JSON5-style comments, trailing commas, single-quoted strings,
+	 * unquoted property names, hexadecimal numbers, Infinity and NaN.
+	 * Time-sliced and chunked parsing ignore this, and stay strict.
+	 */
+	JSON_RELAXED = 1 << 2,
+
+	/*
+	 * Keep numbers that don't survive conversion to double as their exact
+	 * text, in JSON_DECIMAL values. The text points into the parsed string,
+	 * which then needs to outlive the values, except with chunked parsing,
+	 * where it's copied. With JSON_RELAXED, only numbers in standard syntax
+	 * are kept exact, not hexadecimal ones or those like +1 or .5.
+	 */
+	JSON_EXACT_NUMBERS = 1 << 3
+};
+
+void json_set_flags(struct json_parser *p, unsigned flags);
+
+/*
+ * Limits on what a parser will accept, for parsing untrusted input. Zero
+ * means unlimited. max_bytes applies to the memory held by values in the
+ * parser, the others to each parsed document. Regardless of max_depth, all
+ * but time-sliced and chunked parsing stop at a depth of 10000, to stay
+ * within the stack.
+ */
+struct json_limits {
+	size_t max_bytes;
+	size_t max_nodes;
+	size_t max_string_length;
+	int max_depth;
+};
+
+void json_set_limits(struct json_parser *p, const struct json_limits *limits);
+
+/* the memory held by values in the parser, as counted against max_bytes */
+size_t json_memory_usage(const struct json_parser *p);
+
+/*
+ * Calls to malloc(), realloc() and mmap() made by all parsers so far, and the
+ * bytes asked for, in builds with JSON_COUNT_ALLOCS defined. Zero otherwise.
+ * The bytes leave out the parser and document structs themselves, so they
+ * don't vary with the platform.
+ */
+void json_alloc_stats(size_t *calls, size_t *bytes);
+
+/*
+ * The scanning kernels the parser picked for this CPU: "avx512", "avx2",
+ * "sse2", "neon" or "scalar". The JSON_LOL_KERNELS environment variable overrides the choice,
+ * as far as the CPU supports it.
+ */
+const char *json_kernel_name(const struct json_parser *p);
+
+enum json_error {
+	JSON_ERROR_NONE,
+	JSON_ERROR_SYNTAX,
+	JSON_ERROR_MEMORY,
+	JSON_ERROR_LIMIT
+};
+
+/* the kind of error that made the most recent parse fail */
+enum json_error json_last_error(const struct json_parser *p);
+
+/*
+ * Hands the memory of all values returned so far over to a document, that
+ * stays valid after the parser is reused or destroyed. The document's root
+ * is the most recently returned value.
+ *
+ * Documents are immutable and reference counted: json_ref_document() adds
+ * a reference, and json_free_document() drops one, freeing the document
+ * along with the last one. Nothing writes to a document's tree once it is
+ * detached, so any number of threads can read it without locking.
+ */
+struct json_document;
+
+struct json_document *json_detach(struct json_parser *p);
+const struct json_value *json_document_root(const struct json_document *doc);
+struct json_document *json_ref_document(struct json_document *doc);
+void json_free_document(struct json_document *doc);
+/*
+ * Calls cb with each value of the tree under root, parents before children,
+ * along with its property name (NULL outside objects) and depth. A non-zero
+ * return from cb stops the walk, and is returned, as is -1 when out of
+ * memory. The next few siblings of each value are prefetched while it's
+ * visited. Neither this nor json_compact recurse, so any depth is fine.
+ */
+int json_visit(const struct json_value *root,
+               int (*cb)(const struct json_value *, const char *, int, void *),
+               void *data);
+
+/*
+ * Copies the tree under root into a new document, laid out in depth-first
+ * order, so walking it goes through memory front to back. Decimal text is
+ * copied too, so the document doesn't depend on the parsed string. Returns
+ * NULL when out of memory.
+ */
+struct json_document *json_compact(const struct json_value *root);
+
+/*
+ * Parses str, returning NULL and calling err on errors. Values stay valid
+ * until the parser is reset or destroyed, even if later parses fail.
+ */
 struct json_value *json_parse(struct json_parser *p, const char *str,
                               void (*err)(int, const char *));
 
+/*
+ * Parses the next of a sequence of concatenated values, like "{...}{...}",
+ * starting at str + *offset, and advances *offset past it and any trailing
+ * whitespace. Returns NULL once the input is used up, or on errors, after
+ * calling err; json_last_error() tells the two apart. Errors end the
+ * sequence, moving *offset to the end of str.
+ */
+struct json_value *json_parse_next(struct json_parser *p, const char *str,
+                                   size_t *offset,
+                                   void (*err)(int, const char *));
+
+/*
+ * Parses count separate documents in one go, storing their values in roots,
+ * with NULL (or a partial result) for documents that fail. Values share the
+ * parser's memory, like those of json_parse(). Returns the number of errors.
+ * This is a convenience over calling json_parse() on each, not a faster way.
+ */
+int json_parse_batch(struct json_parser *p, const char *const *strs,
+                     size_t count, struct json_value **roots,
+                     void (*err)(int, const char *));
+
+/*
+ * Parses newline-delimited JSON, calling cb with each line's value. Values
+ * are only valid until cb returns, unless cb detaches them. Malformed lines
+ * are reported through err and skipped, and the number of them is returned.
+ */
+int json_parse_lines(struct json_parser *p, const char *str,
+                     void (*cb)(struct json_value *, void *),
+                     void (*err)(int, const char *), void *data);
+
+/*
+ * Time-sliced parsing: json_parse_begin() sets up parsing of str, and each
+ * call to json_parse_step() then consumes roughly max_bytes of input before
+ * returning. json_parse_step() returns non-zero while there's more work left,
+ * and stores the parsed value (or NULL on error) in *value when done. str
+ * must stay valid until then, and json_parse() must not be called meanwhile.
+ * Once done, or without a json_parse_begin(), it returns zero with a NULL
+ * *value, leaving the last parsed value for json_detach().
+ *
+ * Steps only end between tokens, so a token longer than max_bytes, like a
+ * long string, takes a whole step however long it is. Closing a container
+ * does too, as it copies the pointers to all of its members. The
+ * max_string_length and max_nodes limits bound how long either can take.
+ */
+void json_parse_begin(struct json_parser *p, const char *str,
+                      void (*err)(int, const char *));
+int json_parse_step(struct json_parser *p, size_t max_bytes,
+                    struct json_value **value);
+
+/*
+ * Chunked parsing: after json_parse_begin() with a NULL str, input is fed in
+ * arbitrarily split chunks through json_parse_feed(), with a zero len marking
+ * the end of the input. Chunks are copied, so buf can be reused right away.
+ * Returns non-zero while more input is needed, like json_parse_step().
+ */
+int json_parse_feed(struct json_parser *p, const char *buf, size_t len,
+                    struct json_value **value);
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
 #endif /* JSON_H */
@@ -0,0 +1,158 @@
+/*
+ * Microbenchmarks for the lexer's primitives. json.c is built right into
+ * this file, so its static functions can be timed on their own.
+ */
+#include "json.c"
+
+#include <time.h>
+
+#ifdef HAVE_X86_KERNELS
+#include <x86intrin.h>
+#endif
+
+#define INPUT_SIZE (4 << 20)
+
+/* TSC ticks where there's one, nanoseconds otherwise */
+static uint64_t ticks(void)
+{
+#ifdef HAVE_X86_KERNELS
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* repeats token until the input is INPUT_SIZE bytes long */
+static char *repeat(const char *token)
+{
+	size_t len = strlen(token), i;
+	char *ret = malloc(INPUT_SIZE + 1);
+
+	if (!ret) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i + len <= INPUT_SIZE; i += len)
+		memcpy(ret + i, token, len);
+	ret[i] = '\0';
+	return ret;
+}
+
+/* skip_space() over one long run, which stops at the 'x' */
+static void run_skip_space(struct json_parser *p)
+{
+	skip_space(p);
+	if (next(p) != 'x')
+		parse_error(p, "skip_space stopped early");
+}
+
+static void run_string(struct json_parser *p)
+{
+	while (next(p) == '"')
+		parse_raw_string(p);
+}
+
+static void run_hexquad(struct json_parser *p)
+{
+	p->skip_space = 0; /* like inside strings */
+	while (next(p))
+		parse_hexquad(p);
+}
+
+static void run_number(struct json_parser *p)
+{
+	while (next(p))
+		parse_number(p);
+}
+
+static void run_keyword(struct json_parser *p)
+{
+	while (next(p))
+		parse_keyword(p, "true", 4);
+}
+
+static const struct bench {
+	const char *name, *token;
+	void (*run)(struct json_parser *p);
+} benches[] = {
+	{ "skip_space", "\n\t\t\t\t  \r\n\t ", run_skip_space },
+	{ "parse_raw_string (clean)", "\"lorem ipsum dolor sit amet\" ",
+	  run_string },
+	{ "parse_raw_string (escaped)", "\"a\\\"b\\\\c\\nd\\u00e6\\ud83d\\ude00\" ",
+	  run_string },
+	{ "parse_hexquad", "00e6", run_hexquad },
+	{ "parse_number (ints)", "1234567 ", run_number },
+	{ "parse_number (decimals)", "-1234.5678 ", run_number },
+	{ "parse_number (exponents)", "6.02214076e23 ", run_number },
+	{ "parse_keyword", "true ", run_keyword }
+};
+
+static void bench(const struct bench *b, int iterations)
+{
+	struct json_parser *p = json_create_parser();
+	char *input = repeat(b->token);
+	size_t len = strlen(input);
+	uint64_t best_ticks = UINT64_MAX;
+	double best_time = 1e9;
+	int i;
+
+	/* the skip_space() input needs something to stop at */
+	if (b->run == run_skip_space)
+		input[len - 1] = 'x';
+
+	for (i = 0; i < iterations; ++i) {
+		uint64_t start_ticks;
+		double start_time;
+
+		json_reset_parser(p);
+		begin(p, NULL);
+		p->str = input;
+		if (setjmp(p->jmp)) {
+			fprintf(stderr, "%s: %s\n", b->name, p->error);
+			exit(1);
+		}
+
+		start_time = now();
+		start_ticks = ticks();
+		b->run(p);
+		if (ticks() - start_ticks < best_ticks)
+			best_ticks = ticks() - start_ticks;
+		if (now() - start_time < best_time)
+			best_time = now() - start_time;
+	}
+
+	printf("%-28s %8.2f %s %10.1f MB/s\n", b->name,
+	       (double)best_ticks / len,
+#ifdef HAVE_X86_KERNELS
+	       "cycles/byte",
+#else
+	       "ns/byte    ",
+#endif
+	       len / best_time / 1e6);
+
+	free(input);
+	json_destroy_parser(p);
+}
+
+int main(int argc, char *argv[])
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 10;
+	struct json_parser *p = json_create_parser();
+	size_t i;
+
+	printf("kernels: %s\n", json_kernel_name(p));
+	json_destroy_parser(p);
+
+	for (i = 0; i < ARRAY_SIZE(benches); ++i)
+		bench(&benches[i], iterations);
+	return 0;
+}
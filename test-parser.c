@@ -1,8 +1,19 @@
 #include "json.h"
 #include <ctype.h>
+#include <float.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <locale.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 void print_string(const char *str)
 {
@@ -52,13 +63,20 @@ void print_string(const char *str)
 	printf("\"");
 }
 
+/*
+ * With JSON_EXACT_NUMBERS, numbers are written without losing anything: the
+ * ones held as doubles have at most DBL_DIG significant digits, and the rest
+ * are passed through.
+ */
+static int exact_numbers;
+
 void indent(int indent)
 {
 	for (; indent > 0; --indent)
 		printf("\t");
 }
 
-void json_dump(struct json_value *obj, int ind)
+void json_dump(const struct json_value *obj, int ind)
 {
 	int i;
 	switch (obj->type) {
@@ -67,7 +85,14 @@ void json_dump(struct json_value *obj, int ind)
 		break;
 
 	case JSON_NUMBER:
-		printf("%f", obj->value.number);
+		if (exact_numbers)
+			printf("%.*g", DBL_DIG, obj->value.number);
+		else
+			printf("%f", obj->value.number);
+		break;
+
+	case JSON_DECIMAL:
+		printf("%.*s", obj->value.decimal.len, obj->value.decimal.str);
 		break;
 
 	case JSON_OBJECT:
@@ -134,16 +159,549 @@ static char *read_file(FILE *fp)
 	return buf;
 }
 
+/*
+ * Double-buffered reader: a thread fills one buffer while the parser
+ * consumes the other, so reading and parsing overlap. gzip and zstd
+ * compressed input is decompressed on the reader thread as well.
+ */
+struct reader {
+	FILE *fp;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *buf[2];
+	size_t len[2], chunk;
+	int full[2], stop;
+
+	size_t (*read)(struct reader *r, char *buf, size_t len);
+	unsigned char in[65536];
+	size_t in_pos, in_len;
+	int failed;
+#ifdef HAVE_ZLIB
+	z_stream zs;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *zds;
+#endif
+};
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+static int fill_input(struct reader *r)
+{
+	r->in_pos = 0;
+	r->in_len = fread(r->in, 1, sizeof(r->in), r->fp);
+	return r->in_len != 0;
+}
+#endif
+
+static size_t read_raw(struct reader *r, char *buf, size_t len)
+{
+	size_t ret = 0;
+
+	/* hand out what was read while sniffing the format first */
+	if (r->in_pos < r->in_len) {
+		ret = r->in_len - r->in_pos;
+		if (ret > len)
+			ret = len;
+		memcpy(buf, r->in + r->in_pos, ret);
+		r->in_pos += ret;
+	}
+
+	return ret + fread(buf + ret, 1, len - ret, r->fp);
+}
+
+#ifdef HAVE_ZLIB
+static size_t read_gzip(struct reader *r, char *buf, size_t len)
+{
+	z_stream *zs = &r->zs;
+	zs->next_out = (Bytef *)buf;
+	zs->avail_out = len;
+
+	while (zs->avail_out && !r->failed) {
+		int ret;
+
+		if (!zs->avail_in) {
+			if (!fill_input(r))
+				break;
+			zs->next_in = r->in;
+			zs->avail_in = r->in_len;
+		}
+
+		ret = inflate(zs, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END)
+			inflateReset(zs); /* there might be more members */
+		else if (ret != Z_OK) {
+			fprintf(stderr, "inflate: %s\n", zs->msg ? zs->msg : "error");
+			r->failed = 1;
+		}
+	}
+
+	return len - zs->avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static size_t read_zstd(struct reader *r, char *buf, size_t len)
+{
+	ZSTD_outBuffer out = { buf, len, 0 };
+
+	while (out.pos < out.size && !r->failed) {
+		ZSTD_inBuffer in = { r->in, r->in_len, r->in_pos };
+		size_t ret;
+
+		if (r->in_pos == r->in_len) {
+			if (!fill_input(r))
+				break;
+			continue;
+		}
+
+		ret = ZSTD_decompressStream(r->zds, &out, &in);
+		r->in_pos = in.pos;
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(ret));
+			r->failed = 1;
+		}
+	}
+
+	return out.pos;
+}
+#endif
+
+/* pick a decoder based on the magic bytes at the start of the input */
+static void sniff_format(struct reader *r)
+{
+	static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+	static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+	r->read = read_raw;
+	r->in_pos = 0;
+	r->in_len = fread(r->in, 1, sizeof(zstd_magic), r->fp);
+
+#ifdef HAVE_ZLIB
+	if (r->in_len >= sizeof(gzip_magic) &&
+	    !memcmp(r->in, gzip_magic, sizeof(gzip_magic))) {
+		memset(&r->zs, 0, sizeof(r->zs));
+		if (inflateInit2(&r->zs, 15 + 16) != Z_OK) {
+			fprintf(stderr, "inflateInit2 failed\n");
+			exit(1);
+		}
+		r->zs.next_in = r->in;
+		r->zs.avail_in = r->in_len;
+		r->read = read_gzip;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (r->in_len == sizeof(zstd_magic) &&
+	    !memcmp(r->in, zstd_magic, sizeof(zstd_magic))) {
+		r->zds = ZSTD_createDStream();
+		if (!r->zds) {
+			fprintf(stderr, "ZSTD_createDStream failed\n");
+			exit(1);
+		}
+		ZSTD_initDStream(r->zds);
+		r->read = read_zstd;
+	}
+#endif
+	(void)gzip_magic;
+	(void)zstd_magic;
+}
+
+static void *reader_thread(void *arg)
+{
+	struct reader *r = arg;
+	int idx = 0;
+	size_t len;
+
+	sniff_format(r);
+	do {
+		int stop;
+
+		pthread_mutex_lock(&r->lock);
+		while (r->full[idx] && !r->stop)
+			pthread_cond_wait(&r->cond, &r->lock);
+		stop = r->stop;
+		pthread_mutex_unlock(&r->lock);
+		if (stop)
+			break;
+
+		len = r->read(r, r->buf[idx], r->chunk);
+
+		pthread_mutex_lock(&r->lock);
+		r->len[idx] = len;
+		r->full[idx] = 1;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+
+		idx ^= 1;
+	} while (len);
+
+#ifdef HAVE_ZLIB
+	if (r->read == read_gzip)
+		inflateEnd(&r->zs);
+#endif
+#ifdef HAVE_ZSTD
+	if (r->read == read_zstd)
+		ZSTD_freeDStream(r->zds);
+#endif
+	return NULL;
+}
+
+/* the parser in use, so errors can be told apart by kind */
+static struct json_parser *parser;
+
 static void error(int line, const char *str)
 {
-	printf("ERROR:%d: %s\n", line, str);
+	static const char *const kinds[] = {
+		[JSON_ERROR_NONE] = "none",
+		[JSON_ERROR_SYNTAX] = "syntax",
+		[JSON_ERROR_MEMORY] = "memory",
+		[JSON_ERROR_LIMIT] = "limit"
+	};
+
+	printf("ERROR:%d: %s: %s\n", line, kinds[json_last_error(parser)],
+	       str);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-s slice-bytes | -c chunk-bytes | -n | -m | -b] "
+	                "[-p] [-r] [-x] [-C] [-A] [-T threads]\n"
+	                "       [-L bytes|nodes|string|depth=limit]...\n", argv0);
+	exit(1);
+}
+
+/* what a walk over a tree saw, for telling whether two walks agree */
+struct tally {
+	size_t values, bytes;
+};
+
+static int tally_value(const struct json_value *v, const char *name,
+                       int depth, void *data)
+{
+	struct tally *t = data;
+
+	++t->values;
+	t->bytes += name ? strlen(name) : 0;
+	t->bytes += depth;
+	if (v->type == JSON_STRING)
+		t->bytes += strlen(v->value.string);
+	return 0;
 }
 
-int main()
+/* for -T, each thread reads the document through a reference of its own */
+struct sharer {
+	pthread_t thread;
+	struct json_document *doc;
+	struct tally expected;
+	int failed;
+};
+
+static void *share_thread(void *arg)
 {
-	char *str = read_file(stdin);
-	struct json_parser *p = json_create_parser();
-	struct json_value *value = json_parse(p, str, error);
+	struct sharer *s = arg;
+	struct tally t = { 0, 0 };
+
+	json_visit(json_document_root(s->doc), tally_value, &t);
+	s->failed = t.values != s->expected.values ||
+	            t.bytes != s->expected.bytes;
+	json_free_document(s->doc);
+	return NULL;
+}
+
+static struct sharer *share_document(struct json_document *doc, int count)
+{
+	struct sharer *sharers = calloc(count, sizeof(*sharers));
+	struct tally t = { 0, 0 };
+	int i;
+
+	if (!sharers) {
+		perror("calloc");
+		exit(1);
+	}
+
+	json_visit(json_document_root(doc), tally_value, &t);
+	for (i = 0; i < count; ++i) {
+		sharers[i].doc = json_ref_document(doc);
+		sharers[i].expected = t;
+		if (pthread_create(&sharers[i].thread, NULL, share_thread,
+		                   &sharers[i])) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+	return sharers;
+}
+
+/* waits for the threads, which may outlive every other reference */
+static void unshare_document(struct sharer *sharers, int count)
+{
+	int i, failed = 0;
+
+	for (i = 0; i < count; ++i) {
+		pthread_join(sharers[i].thread, NULL);
+		failed |= sharers[i].failed;
+	}
+	free(sharers);
+	if (failed) {
+		fprintf(stderr, "threads saw different trees\n");
+		exit(1);
+	}
+}
+
+static void dump_record(struct json_value *value, void *data)
+{
+	(void)data;
+	json_dump(value, 0);
+	putchar('\n');
+}
+
+/* for -A, in allocation-counting builds, checked against t/NNNN.allocs */
+static void print_alloc_stats(void)
+{
+	size_t calls, bytes;
+	json_alloc_stats(&calls, &bytes);
+	fprintf(stderr, "calls %zu\nbytes %zu\n", calls, bytes);
+}
+
+static int parse_limit(struct json_limits *limits, const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	unsigned long val;
+	char *end;
+
+	if (!eq)
+		return -1;
+
+	val = strtoul(eq + 1, &end, 10);
+	if (*end || end == eq + 1)
+		return -1;
+
+	if (!strncmp(arg, "bytes=", eq - arg + 1))
+		limits->max_bytes = val;
+	else if (!strncmp(arg, "nodes=", eq - arg + 1))
+		limits->max_nodes = val;
+	else if (!strncmp(arg, "string=", eq - arg + 1))
+		limits->max_string_length = val;
+	else if (!strncmp(arg, "depth=", eq - arg + 1))
+		limits->max_depth = val;
+	else
+		return -1;
+	return 0;
+}
+
+/* parses each line of str as a document of its own, in a single batch */
+static void parse_batch(struct json_parser *p, char *str)
+{
+	const char **strs = NULL;
+	struct json_value **roots;
+	size_t i, count = 0;
+	char *line, *eol;
+
+	for (line = str; *line; line = eol + 1) {
+		eol = strchr(line, '\n');
+		if (!(count & (count - 1))) {
+			strs = realloc(strs, sizeof(*strs) * (count ? 2 * count : 1));
+			if (!strs) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		strs[count++] = line;
+		if (!eol)
+			break;
+		*eol = '\0';
+		line = eol + 1;
+	}
+
+	roots = malloc(sizeof(*roots) * (count ? count : 1));
+	if (!roots) {
+		perror("malloc");
+		exit(1);
+	}
+
+	json_parse_batch(p, strs, count, roots, error);
+	for (i = 0; i < count; ++i) {
+		if (!roots[i])
+			continue;
+		json_dump(roots[i], 0);
+		putchar('\n');
+	}
+	free(strs);
+	free(roots);
+}
+
+static struct json_value *parse_chunked(struct json_parser *p, FILE *fp,
+                                        size_t chunk)
+{
+	static struct reader r = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER
+	};
+	struct json_value *value;
+	pthread_t thread;
+	int idx = 0, more;
+
+	r.fp = fp;
+	r.chunk = chunk;
+	r.buf[0] = malloc(chunk);
+	r.buf[1] = malloc(chunk);
+	if (!r.buf[0] || !r.buf[1]) {
+		perror("malloc");
+		exit(1);
+	}
+	if (pthread_create(&thread, NULL, reader_thread, &r)) {
+		fprintf(stderr, "pthread_create failed\n");
+		exit(1);
+	}
+
+	json_parse_begin(p, NULL, error);
+	do {
+		pthread_mutex_lock(&r.lock);
+		while (!r.full[idx])
+			pthread_cond_wait(&r.cond, &r.lock);
+		pthread_mutex_unlock(&r.lock);
+
+		more = json_parse_feed(p, r.buf[idx], r.len[idx], &value);
+
+		pthread_mutex_lock(&r.lock);
+		r.full[idx] = 0;
+		if (!more)
+			r.stop = 1;
+		pthread_cond_signal(&r.cond);
+		pthread_mutex_unlock(&r.lock);
+
+		idx ^= 1;
+	} while (more);
+
+	pthread_join(thread, NULL);
+	fclose(fp);
+	free(r.buf[0]);
+	free(r.buf[1]);
+	return value;
+}
+
+int main(int argc, char *argv[])
+{
+	char *str = NULL;
+	struct json_parser *p;
+	struct json_document *doc;
+	struct json_value *value;
+	struct sharer *sharers = NULL;
+	struct json_limits limits = { 0, 0, 0, 0 };
+	long slice = 0, chunk = 0;
+	unsigned flags = 0;
+	int opt, lines = 0, multi = 0, batch = 0, compact = 0, threads = 0;
+
+	while ((opt = getopt(argc, argv, "s:c:nmbprxCAT:L:")) != -1) {
+		switch (opt) {
+		case 's':
+			slice = atol(optarg);
+			if (slice <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'c':
+			chunk = atol(optarg);
+			if (chunk <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'n':
+			lines = 1;
+			break;
+
+		case 'm':
+			multi = 1;
+			break;
+
+		case 'b':
+			batch = 1;
+			break;
+
+		case 'p':
+			flags |= JSON_PARTIAL_RESULTS;
+			break;
+
+		case 'r':
+			flags |= JSON_RELAXED;
+			break;
+
+		case 'x':
+			flags |= JSON_EXACT_NUMBERS;
+			exact_numbers = 1;
+			break;
+
+		case 'C':
+			compact = 1;
+			break;
+
+		case 'A':
+			atexit(print_alloc_stats);
+			break;
+
+		case 'T':
+			threads = atoi(optarg);
+			if (threads <= 0)
+				usage(argv[0]);
+			break;
+
+		case 'L':
+			if (parse_limit(&limits, optarg) < 0)
+				usage(argv[0]);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* relaxed syntax is only supported by the recursive parser */
+	if (flags & JSON_RELAXED)
+		slice = chunk = 0;
+
+	p = parser = json_create_parser();
+	json_set_flags(p, flags);
+	json_set_limits(p, &limits);
+	if (lines) {
+		/* newline-delimited input has an engine of its own */
+		str = read_file(stdin);
+		json_parse_lines(p, str, dump_record, error, NULL);
+		json_destroy_parser(p);
+		free(str);
+		return 0;
+	}
+
+	if (batch) {
+		str = read_file(stdin);
+		parse_batch(p, str);
+		json_destroy_parser(p);
+		free(str);
+		return 0;
+	}
+
+	if (multi) {
+		/* so is a stream of concatenated values */
+		size_t offset = 0;
+		str = read_file(stdin);
+		while ((value = json_parse_next(p, str, &offset, error))) {
+			json_dump(value, 0);
+			putchar('\n');
+		}
+		json_destroy_parser(p);
+		free(str);
+		return 0;
+	}
+
+	if (chunk)
+		value = parse_chunked(p, stdin, chunk);
+	else {
+		str = read_file(stdin);
+		if (slice) {
+			json_parse_begin(p, str, error);
+			while (json_parse_step(p, slice, &value))
+				;
+		} else
+			value = json_parse(p, str, error);
+	}
 
 	if (!value) {
 		json_destroy_parser(p);
@@ -151,10 +709,34 @@ int main()
 		exit(0);
 	}
 
-	json_dump(value, 0);
-	putchar('\n');
-
+	/*
+	 * The tree should outlive both the parser and the input, unless exact
+	 * numbers point into the input. Compacting copies those too.
+	 */
+	doc = json_detach(p);
 	json_destroy_parser(p);
+	if (doc && compact) {
+		struct json_document *tmp = json_compact(json_document_root(doc));
+		json_free_document(doc);
+		doc = tmp;
+	}
+	if (!exact_numbers || compact) {
+		free(str);
+		str = NULL;
+	}
+	if (!doc) {
+		perror("json_detach");
+		exit(1);
+	}
+
+	/* other threads read it meanwhile, and drop their references last */
+	if (threads)
+		sharers = share_document(doc, threads);
+	json_dump(json_document_root(doc), 0);
+	putchar('\n');
+	json_free_document(doc);
+	if (threads)
+		unshare_document(sharers, threads);
 	free(str);
 
 	return 0;